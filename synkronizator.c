@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -12,16 +13,88 @@
 #include <time.h>
 #include <libpq-fe.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 static int verbose_flag;
 static int port = -1;
+static int auth_timeout = 30; // secondes, 0 pour désactiver
+static int idle_timeout = 300; // secondes, 0 pour désactiver
+static int db_timeout = 10; // secondes, 0 pour désactiver
+static int keepalive_idle = 60; // secondes, 0 pour désactiver
+static int rate_limit = 5; // commandes par seconde et par unité de poids, 0 pour désactiver
+static int replica_max_lag = 10; // secondes de retard tolérées sur un réplica
+static int sticky_window = 15; // secondes de lecture sur le primaire après une écriture
+static const char *snapshot_path = NULL; // calendrier en mémoire et snapshot, désactivés par défaut
 const char *log_path = "application.log";
 
-const int BUFFER_SIZE = 2048;
+#define BUFFER_SIZE 2048
 
 static char ip_address[INET_ADDRSTRLEN] = "";
 
-char conninfo[BUFFER_SIZE]; 
+#define MAX_REPLICAS 8
+#define HEALTH_CHECK_INTERVAL 5 // secondes
+#define LSN_READINGS 16 // relevés du primaire conservés, soit 80 secondes d'historique
+
+// Premier membre des structures enregistrées dans epoll : indique à qui revient l'événement
+typedef enum {
+    EVENT_CLIENT,
+    EVENT_DATABASE
+} EventKind;
+
+typedef enum {
+    DB_DISCONNECTED,
+    DB_CONNECTING,
+    DB_IDLE,
+    DB_BUSY
+} DbState;
+
+typedef enum {
+    PROBE_IDLE,
+    PROBE_CONNECTING,
+    PROBE_QUERYING
+} ProbeState;
+
+// Serveur PostgreSQL, avec sa connexion persistante non bloquante et sa file de requêtes
+typedef struct DbServer {
+    EventKind kind;
+    char name[128]; // host[:port], pour les logs
+    char conninfo[BUFFER_SIZE];
+    PGconn *conn;
+    DbState state;
+    int fd; // socket enregistrée dans epoll, -1 sinon
+    uint32_t events;
+    int reused; // la connexion a déjà servi, elle a pu être coupée entre-temps
+    struct DbQuery *running;
+    PGresult *result; // premier résultat de la requête en cours
+    struct DbQuery *queue_head;
+    struct DbQuery *queue_tail;
+    int replica;
+    int healthy;
+    double lag; // secondes
+    PGconn *probe; // connexion non bloquante de la vérification de santé
+    ProbeState probe_state;
+    short probe_events; // attente de PQconnectPoll
+    uint64_t probe_deadline;
+    uint64_t probe_sent_ms;
+    uint64_t synced_ms; // relevé du primaire le plus récent rejoué par le réplica
+} DbServer;
+
+typedef enum {
+    DB_READ,
+    DB_WRITE
+} DbAccess;
+
+static DbServer primary;
+static DbServer replicas[MAX_REPLICAS];
+static int replica_count = 0;
 
 typedef struct {
     int list_logements : 1;
@@ -38,18 +111,192 @@ typedef struct {
     Permissions perms;
 } User;
 
-User* authenticate(const char* api_key);
+#define MAX_EVENTS 64
+#define MAX_IOV 64
+#define OUTPUT_HIGH_WATER (64 * 1024) // au-delà, on arrête de lire les commandes du client
+#define OUTPUT_GLOBAL_LIMIT (16 * 1024 * 1024) // total en attente, tous clients confondus
+#define STALL_TIMEOUT 30 // secondes sans progression avant éviction
+#define KEEPALIVE_INTERVAL 10
+#define KEEPALIVE_COUNT 3
+
+#define TICK_MS 250
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4 // 64 slots par niveau : 16s, 17min, 18h, 48 jours
+
+#define QUOTA_BUCKETS 256
+#define RATE_BURST_SECONDS 4 // capacité du seau, en secondes de débit
+#define MAX_PENDING_PER_USER 32
+#define DB_MAX_RUNNING 4 // commandes en cours sur la base, tous serveurs confondus
+#define MAX_QUERY_PARAMS 4
+
+#define SNAPSHOT_MAGIC "SYNKSNAP"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_INTERVAL 60 // secondes
+#define SNAPSHOT_PATH_MAX 1024 // avec le suffixe ".tmp"
+#define SNAPSHOT_MAX_AGE (6 * 24 * 3600) // secondes, le journal des modifications est purgé après 7 jours
+#define HOUSING_REFRESH_INTERVAL 2 // secondes entre deux rattrapages
+#define HOUSING_RETRY_INTERVAL 30 // secondes, après un échec
+#define HOUSING_MAX_AGE 10 // secondes sans rattrapage avant de revenir à la base
+
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+// Timer intrusif, rangé dans une roue hiérarchique (ajout et annulation en O(1))
+typedef struct Timer {
+    struct Timer *prev;
+    struct Timer *next;
+    uint64_t expires; // en ticks
+    void (*callback)(struct Timer *timer);
+} Timer;
+
+// Seau à jetons et file d'attente d'un utilisateur, partagés entre ses connexions
+typedef struct Quota {
+    char id[50];
+    int weight;
+    double tokens;
+    uint64_t refilled_ms;
+    double vstart; // temps virtuel de la prochaine commande servie
+    double vfinish;
+    int refs;
+    int pending;
+    struct Connection *queue_head;
+    struct Connection *queue_tail;
+    struct Quota *active_prev;
+    struct Quota *active_next;
+    int active;
+    Timer expiry; // libération une fois le seau rempli et sans connexion
+    struct Quota *next;
+} Quota;
+
+// Morceau de réponse en attente d'envoi (chaîne envoyée via writev)
+typedef struct OutChunk {
+    struct OutChunk *next;
+    size_t len;
+    size_t offset;
+    char data[];
+} OutChunk;
+
+typedef enum {
+    CNX_WAIT_AUTH,
+    CNX_WAIT_ACTION
+} ConnectionState;
+
+typedef struct Connection {
+    EventKind kind;
+    int fd;
+    char ip[INET_ADDRSTRLEN];
+    ConnectionState state;
+    User *user;
+    OutChunk *out_head;
+    OutChunk *out_tail;
+    size_t out_bytes;
+    Timer timeout; // authentification puis inactivité
+    Timer stall_timer; // file d'envoi bloquée
+    Quota *quota;
+    char *command; // commande en attente de la base
+    int cost;
+    int busy; // commande ou authentification en cours sur la base
+    struct DbQuery *query;
+    struct Connection *job_prev;
+    struct Connection *job_next;
+    uint64_t wrote_ms; // dernière écriture, pour relire sur le primaire
+    uint32_t events; // masque epoll actuellement enregistré
+    int paused; // file d'envoi au-dessus du seuil
+    int closing; // QUIT reçu, on ferme une fois la file vidée
+    int dead;
+    struct Connection *prev;
+    struct Connection *next;
+} Connection;
+
+typedef void (*DbCallback)(Connection *cnx, PGresult *res, void *data);
+
+// Requête en file sur un serveur. done est appelé une seule fois : res vaut NULL en cas
+// d'erreur, cnx vaut NULL si le client s'est déconnecté entre-temps.
+typedef struct DbQuery {
+    struct DbQuery *next;
+    DbServer *db;
+    Connection *cnx;
+    const char *sql;
+    char *params[MAX_QUERY_PARAMS];
+    int param_count;
+    int reused;
+    int retried;
+    Timer deadline; // db_timeout, file d'attente comprise
+    DbCallback done;
+    void *data;
+} DbQuery;
+
+// Réservation, identique en mémoire et dans le snapshot
+typedef struct {
+    char debut[11]; // YYYY-MM-DD
+    char fin[11];
+} Reservation;
+
+typedef struct {
+    int64_t id;
+    char owner[50];
+    char titre[256];
+    const Reservation *reservations; // triées par début, dans le snapshot projeté ou allouées
+    int reservation_count;
+    int owned; // reservations allouées par le cache
+} Housing;
+
+typedef struct {
+    Housing *housings; // triés par id
+    int count;
+    void *mapping; // snapshot projeté, gardé tant que des réservations y pointent
+    size_t mapping_size;
+    uint64_t position; // xmin du dernier rattrapage : les transactions à partir de celle-ci restent à relire
+    int64_t synced_at; // heure du dernier rattrapage, sauvegardée avec la position
+    uint64_t synced_ms;
+    int loaded;
+    int dirty; // modifié depuis la dernière écriture du snapshot
+} HousingCache;
+
+// Format du snapshot : en-tête, tableau de SnapshotHousing, puis les réservations de chaque logement à la suite
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t housing_count;
+    uint32_t reservation_count;
+    uint32_t reserved;
+    uint64_t position;
+    int64_t synced_at;
+    uint64_t checksum; // FNV-1a de tout ce qui suit l'en-tête
+} SnapshotHeader;
+
+typedef struct {
+    int64_t id;
+    char owner[50];
+    char titre[256];
+    uint32_t reservation_count;
+} SnapshotHousing;
+
+void authenticate(Connection *cnx, const char *api_key);
 
 void output_log(const char *msg);
 void error(const char *msg, int isFromLog);
 void help();
 void launch_socket();
-PGresult* request(const char *sql, const char **paramValues, int paramCount);
+void timer_add(Timer *timer, uint64_t delay_ms, void (*callback)(Timer *timer));
+void timer_cancel(Timer *timer);
+ssize_t conn_send(Connection *cnx, const void *data, size_t len);
+void conn_flush(Connection *cnx);
+void conn_close(Connection *cnx);
+void scheduler_remove(Connection *cnx);
+void quota_release(Quota *quota);
+DbServer* db_route(Connection *cnx, DbAccess access);
+void db_health_check(Timer *timer);
+void housing_cache_start();
+void housing_cache_stop();
+void db_submit(DbServer *db, Connection *cnx, const char *sql, const char **paramValues, int paramCount, DbCallback done, void *data);
+void db_ready(DbServer *db, uint32_t events);
 const char* pg_get_attribute(PGresult *res, int row, const char *attribute_name);
-void list_all(int cnx, User *usr);
-void get_planning(int cnx, User *usr, const char *buffer);
+int list_all(Connection *cnx, User *usr);
+int get_planning(Connection *cnx, User *usr, const char *buffer);
 int validate_date(const char* input);
-void set_availability(int cnx, User *usr, const char *buffer);
+int set_availability(Connection *cnx, User *usr, const char *buffer);
 
 Permissions extract_permissions(const char* permission_string) {
     Permissions perms = {0};
@@ -69,6 +316,14 @@ static struct option long_options[] = {
     {"port", required_argument, 0, 'p'},
     {"verbose", no_argument, 0, 'v'},
     {"log", required_argument, 0, 'l'},
+    {"auth-timeout", required_argument, 0, 'a'},
+    {"idle-timeout", required_argument, 0, 'i'},
+    {"db-timeout", required_argument, 0, 'd'},
+    {"keepalive", required_argument, 0, 'k'},
+    {"rate-limit", required_argument, 0, 'r'},
+    {"replica-lag", required_argument, 0, 'g'},
+    {"sticky-window", required_argument, 0, 's'},
+    {"snapshot", required_argument, 0, 'n'},
     {0, 0, 0, 0}
 };
 
@@ -92,7 +347,7 @@ char *trim_whitespace(char *str) {
     return str;
 }
 
-void parse_env_file(const char *filename, char *host, char *dbname, char *user, char *password) {
+void parse_env_file(const char *filename, char *host, char *dbname, char *user, char *password, char *replica_servers) {
     FILE *file = fopen(filename, "r");
     if (file == NULL) {
         perror("Could not open .env file");
@@ -111,18 +366,45 @@ void parse_env_file(const char *filename, char *host, char *dbname, char *user,
             strcpy(user, trim_whitespace(trimmed_line + 8));
         } else if (strncasecmp(trimmed_line, "DB_PASS=", 8) == 0) {
             strcpy(password, trim_whitespace(trimmed_line + 8));
+        } else if (strncasecmp(trimmed_line, "DB_REPLICA_SERVERS=", 19) == 0) {
+            strcpy(replica_servers, trim_whitespace(trimmed_line + 19));
         }
     }
 
     fclose(file);
 }
 
+void build_conninfo(DbServer *db, const char *server, const char *dbname, const char *user, const char *password) {
+    char host[128] = {0};
+    char *port = NULL;
+
+    db->kind = EVENT_DATABASE;
+    db->fd = -1;
+    snprintf(host, sizeof(host), "%s", server);
+    snprintf(db->name, sizeof(db->name), "%s", server);
+
+    // host:port, le port est optionnel
+    char *colon = strrchr(host, ':');
+    if (colon != NULL) {
+        *colon = '\0';
+        port = colon + 1;
+    }
+
+    snprintf(db->conninfo, sizeof(db->conninfo), "host=%s dbname=%s user=%s password=%s", host, dbname, user, password);
+    if (port != NULL) {
+        snprintf(db->conninfo + strlen(db->conninfo), sizeof(db->conninfo) - strlen(db->conninfo), " port=%s", port);
+    }
+    if (db_timeout > 0) {
+        // Une requête abandonnée coupe la connexion sans PQcancel (bloquant) : le serveur l'arrête lui-même
+        snprintf(db->conninfo + strlen(db->conninfo), sizeof(db->conninfo) - strlen(db->conninfo), " options='-c statement_timeout=%d'", db_timeout * 1000);
+    }
+}
 
 int main(int argc, char *argv[]) {
     int opt;
     int opt_index = 0;
 
-    while ((opt = getopt_long(argc, argv, "hp:vl:", long_options, &opt_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hp:vl:a:i:d:k:r:g:s:n:", long_options, &opt_index)) != -1) {
         switch (opt) {
             case 'h':
                 help();
@@ -139,11 +421,53 @@ int main(int argc, char *argv[]) {
                 log_path = optarg;
                 printf("[OPTION] Log file set to %s\n", log_path);
                 break;
+            case 'a':
+                auth_timeout = atoi(optarg);
+                printf("[OPTION] Auth timeout set to %ds\n", auth_timeout);
+                break;
+            case 'i':
+                idle_timeout = atoi(optarg);
+                printf("[OPTION] Idle timeout set to %ds\n", idle_timeout);
+                break;
+            case 'd':
+                db_timeout = atoi(optarg);
+                printf("[OPTION] Database timeout set to %ds\n", db_timeout);
+                break;
+            case 'k':
+                keepalive_idle = atoi(optarg);
+                printf("[OPTION] TCP keepalive set to %ds\n", keepalive_idle);
+                break;
+            case 'r':
+                rate_limit = atoi(optarg);
+                printf("[OPTION] Rate limit set to %d commands/s\n", rate_limit);
+                break;
+            case 'g':
+                replica_max_lag = atoi(optarg);
+                printf("[OPTION] Replica max lag set to %ds\n", replica_max_lag);
+                break;
+            case 's':
+                sticky_window = atoi(optarg);
+                printf("[OPTION] Sticky window set to %ds\n", sticky_window);
+                break;
+            case 'n':
+                if (strlen(optarg) + strlen(".tmp") >= SNAPSHOT_PATH_MAX) {
+                    printf("Error: Snapshot path too long.\n");
+                    exit(EXIT_FAILURE);
+                }
+                snapshot_path = optarg;
+                printf("[OPTION] Snapshot file set to %s\n", snapshot_path);
+                break;
             default:
                 help();
                 exit(EXIT_FAILURE);
         }
     }
+    // Un réplica peut être en retard de replica_max_lag, et ce retard grandit jusqu'à la
+    // vérification suivante : en deçà, un client pourrait ne pas relire sa propre écriture.
+    if (sticky_window < replica_max_lag + HEALTH_CHECK_INTERVAL) {
+        sticky_window = replica_max_lag + HEALTH_CHECK_INTERVAL;
+        printf("[OPTION] Sticky window raised to %ds (replica lag + %ds between health checks)\n", sticky_window, HEALTH_CHECK_INTERVAL);
+    }
     if (port <= 0) {
         printf("Error: Port must be defined.\n");
         help();
@@ -154,15 +478,30 @@ int main(int argc, char *argv[]) {
     char dbname[128] = {0};
     char user[128] = {0};
     char password[128] = {0};
+    char replica_servers[MAX_LINE_LENGTH] = {0};
 
-    parse_env_file(".env", host, dbname, user, password);
+    parse_env_file(".env", host, dbname, user, password, replica_servers);
 
     if (strlen(host) == 0 || strlen(dbname) == 0 || strlen(user) == 0 || strlen(password) == 0) {
         printf("One or more environment variables are missing\n");
         return 1;
     }
 
-    snprintf(conninfo, sizeof(conninfo), "host=%s dbname=%s user=%s password=%s", host, dbname, user, password);
+    build_conninfo(&primary, host, dbname, user, password);
+
+    char *saveptr = NULL;
+    for (char *server = strtok_r(replica_servers, ",", &saveptr); server != NULL; server = strtok_r(NULL, ",", &saveptr)) {
+        server = trim_whitespace(server);
+        if (strlen(server) == 0) continue;
+        if (replica_count == MAX_REPLICAS) {
+            printf("Too many replicas, only the first %d are used\n", MAX_REPLICAS);
+            break;
+        }
+        build_conninfo(&replicas[replica_count], server, dbname, user, password);
+        replicas[replica_count].replica = 1;
+        printf("[OPTION] Replica %s added\n", server);
+        replica_count++;
+    }
 
 
     launch_socket();
@@ -216,6 +555,14 @@ void help() {
     printf("  --%-*s  %s\n", 7, "help", "Show the different options available for this command.");
     printf("  --%-*s  %s\n", 7, "verbose", "Log entirely the server.");
     printf("  --%-*s  %s\n", 7, "log", "Define the file for the log output, default is application.log");
+    printf("  --%-*s  %s\n", 13, "auth-timeout", "Seconds allowed to send the API key, default is 30 (0 to disable).");
+    printf("  --%-*s  %s\n", 13, "idle-timeout", "Seconds without activity before disconnection, default is 300 (0 to disable).");
+    printf("  --%-*s  %s\n", 13, "db-timeout", "Seconds before a database query is abandoned, default is 10 (0 to disable).");
+    printf("  --%-*s  %s\n", 13, "keepalive", "Seconds of silence before TCP keepalive probes, default is 60 (0 to disable).");
+    printf("  --%-*s  %s\n", 13, "rate-limit", "Database commands per second and per weight unit of a user, default is 5 (0 to disable).");
+    printf("  --%-*s  %s\n", 13, "replica-lag", "Seconds of replication lag before a replica stops serving reads, default is 10.");
+    printf("  --%-*s  %s\n", 13, "sticky-window", "Seconds during which a client reads from the primary after a write, default is 15 (at least replica-lag + 5).");
+    printf("  --%-*s  %s\n", 13, "snapshot", "Serve LIST_ALL and GET_PLANNING from memory, saved to this file for fast restarts (disabled by default).");
 }
 
 void clean_input(char *str) {
@@ -232,447 +579,2418 @@ void clean_input(char *str) {
     *dst = '\0';
 }
 
-void launch_socket() {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    int size;
-    int cnx;
-    char log_msg[BUFFER_SIZE]; // buffer pour les logs
-    char response[BUFFER_SIZE]; // buffer pour les responses
-    struct sockaddr_in addr;
-    char formatter[BUFFER_SIZE]; // buffer pour formatter des chaines temporairement
-    char buffer[BUFFER_SIZE]; // buffer pour les saisies
+static Timer wheel[WHEEL_LEVELS][WHEEL_SIZE]; // sentinelles des listes circulaires
+static uint64_t wheel_now = 0; // tick courant
+static uint64_t wheel_start_ms = 0;
 
-    struct sockaddr_in conn_addr;
-    User *user = NULL;
-    
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        error("Socket Initialization", 0);
-    }
+uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    if (listen(sock, 1) < 0) {
-        error("Socket Initialization", 0);
+void timer_init() {
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SIZE; slot++) {
+            wheel[level][slot].prev = &wheel[level][slot];
+            wheel[level][slot].next = &wheel[level][slot];
+        }
     }
+    wheel_now = 0;
+    wheel_start_ms = monotonic_ms();
+}
 
-    snprintf(log_msg, BUFFER_SIZE, "[Socket] Listening on port: %d", port);
-    output_log(log_msg);
+void timer_link(Timer *head, Timer *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
 
-    size = sizeof(conn_addr);
+void timer_place(Timer *timer) {
+    uint64_t max_delta = (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    if (timer->expires < wheel_now) timer->expires = wheel_now;
+    if (timer->expires - wheel_now > max_delta) timer->expires = wheel_now + max_delta;
 
-    printf("Waiting for connection...\n");
+    uint64_t delta = timer->expires - wheel_now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    int slot = (timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    timer_link(&wheel[level][slot], timer);
+}
 
-    while(1) {
-        inet_ntop(AF_INET, &conn_addr.sin_addr, ip_address, INET_ADDRSTRLEN);
+void timer_cancel(Timer *timer) {
+    if (timer->next == NULL) return;
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = NULL;
+    timer->next = NULL;
+}
 
-        if ((cnx = accept(sock, (struct sockaddr *)&conn_addr, (socklen_t *)&size)) < 0) {
-            error("Socket Initialization", 0);
-        }
-        output_log("[Socket] New connection");
+void timer_add(Timer *timer, uint64_t delay_ms, void (*callback)(Timer *timer)) {
+    timer_cancel(timer);
+    uint64_t ticks = (delay_ms + TICK_MS - 1) / TICK_MS;
+    timer->expires = wheel_now + (ticks > 0 ? ticks : 1);
+    timer->callback = callback;
+    timer_place(timer);
+}
 
-        while(1) {
-            user = NULL;
-            do {
-                memset(buffer, 0, sizeof(buffer));
-                if (write(cnx, "WAIT AUTH\n", 11) <= 0) break;
-                output_log("Waiting for API key...");
-                printf("Waiting for API Key...\n");
-                int valread = read(cnx, buffer, BUFFER_SIZE);
-                if (valread <= 0) break;
-                clean_input(buffer);
-                
-                snprintf(log_msg, BUFFER_SIZE, "API Key received : %s", buffer);
-                output_log(log_msg);
-                user = authenticate(buffer);
-
-                if (user == NULL){
-                    snprintf(log_msg, BUFFER_SIZE, "AUTH REFUSED (%s)", buffer);
-                    output_log(log_msg);
-                    strcat(log_msg, "\n");
-                    if (send(cnx, log_msg, strlen(log_msg), 0) <= 0) break;
-                }
-                memset(buffer, 0, sizeof(buffer));
-            } while(user == NULL);
+// Détache une liste de la roue vers une sentinelle locale, pour pouvoir
+// annuler ou réarmer des timers pendant qu'on la parcourt.
+void timer_detach(Timer *head, Timer *list) {
+    if (head->next == head) {
+        list->prev = list;
+        list->next = list;
+        return;
+    }
+    list->next = head->next;
+    list->prev = head->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    head->prev = head;
+    head->next = head;
+}
 
-            if (user == NULL) break;
+void timer_advance(uint64_t now_ms) {
+    uint64_t target = (now_ms - wheel_start_ms) / TICK_MS;
+    Timer list;
 
-            snprintf(log_msg, BUFFER_SIZE, "[Authentification] API Key OK (%s)", user->name);
-            output_log(log_msg);
+    while (wheel_now < target) {
+        wheel_now++;
 
-            snprintf(response, BUFFER_SIZE, "AUTH OK %s\n", user->name);
-            if (send(cnx, response, strlen(response), 0) <= 0) break;
-
-            while (1) {
-                memset(buffer, 0, BUFFER_SIZE);
-                printf("Waiting for action...\n");
-                if (send(cnx, "WAIT ACTION\n", 13, 0) <= 0) break;
-                output_log("Waiting for action...");
-                int valread = read(cnx, buffer, BUFFER_SIZE);
-                if (valread <= 0) break;
-
-                memset(response, 0, sizeof(response));
-                memset(log_msg, 0, sizeof(log_msg));
-
-                snprintf(log_msg, BUFFER_SIZE, "[Command] Received %s", buffer);
-                output_log(log_msg);
-
-                if (strncasecmp(buffer, "LIST_ALL", 8) == 0) {
-                    list_all(cnx, user);
-                } else if (strncasecmp(buffer, "GET_PLANNING", 12) == 0) {
-                    get_planning(cnx, user, buffer);
-                } else if (strncasecmp(buffer, "HELP", 4) == 0) {
-                    snprintf(response, BUFFER_SIZE, "%-*s  %s\n", 36, "LIST_ALL", "List all logement.");
-                    snprintf(formatter, BUFFER_SIZE, "%-*s  %s\n", 36, "GET_PLANNING <ID> <DEBUT> [FIN]", "List planing of specified logement. <ID>: Housing ID, <START>: Date of start, [END]; Date of end (optionnal).");
-                    strcat(response, formatter);
-                    snprintf(formatter, BUFFER_SIZE, "%-*s  %s\n", 36, "SET_AVAILABILITY <ID> <0/1>", "Set availability of the housing (0: Not availible, 1 : Availible). <ID>: Housing ID, <START>: Date of start, [END]; Date of end (optionnal).");
-                    strcat(response, formatter);
-                    snprintf(formatter, BUFFER_SIZE, "%-*s  %s\n", 36, "HELP", "Show the help.");
-                    strcat(response, formatter);
-                    snprintf(formatter, BUFFER_SIZE, "%-*s  %s\n", 36, "QUIT", "Quit the syslog.");                
-                    strcat(response, formatter);
-                    if (send(cnx, response, strlen(response), 0) <= 0) break;
-                } else if (strncasecmp(buffer, "SET_AVAILABILITY", 16) == 0) {
-                    set_availability(cnx, user, buffer);
-                } else if (strncasecmp(buffer, "QUIT", 4) == 0) {
-                    break;
-                } else {
-                    memset(log_msg, 0, sizeof(log_msg));
-                    if (send(cnx, "ACTION NOT FOUND\n", 18, 0) <= 0) break;
-                    snprintf(log_msg, BUFFER_SIZE, "[Command] Unknown Command (%s)", buffer);
-                    output_log(log_msg);
-                }
-            }
-            
-            if (user != NULL) {
-                free(user);
-                user = NULL;
+        // Redescend les niveaux supérieurs en commençant par le plus haut
+        int level = 1;
+        while (level < WHEEL_LEVELS && (wheel_now & ((1ULL << (WHEEL_BITS * level)) - 1)) == 0) {
+            level++;
+        }
+        for (level = level - 1; level >= 1; level--) {
+            timer_detach(&wheel[level][(wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK], &list);
+            while (list.next != &list) {
+                Timer *timer = list.next;
+                timer_cancel(timer);
+                timer_place(timer);
             }
-            break; 
         }
-        
-        close(cnx);
-        output_log("[Socket] Disconnection");
+
+        timer_detach(&wheel[0][wheel_now & WHEEL_MASK], &list);
+        while (list.next != &list) {
+            Timer *timer = list.next;
+            timer_cancel(timer);
+            timer->callback(timer);
+        }
     }
 }
 
-PGresult* request(const char *sql, const char **paramValues, int paramCount) {
-    PGconn *conn = PQconnectdb(conninfo);
-    char buffer[BUFFER_SIZE];
-    if (PQstatus(conn) != CONNECTION_OK) {
-        snprintf(buffer, sizeof(buffer), "Connection to database failed: %s", PQerrorMessage(conn));
-        output_log(buffer);
-        PQfinish(conn);
-        return NULL;
-    }
-    PGresult *res;
+// Délai avant le prochain tick, pour epoll_wait
+int timer_next_timeout(uint64_t now_ms) {
+    return TICK_MS - (int)((now_ms - wheel_start_ms) % TICK_MS);
+}
 
-    if (paramCount > 0){
-        res = PQexecParams(conn, sql, paramCount, NULL, paramValues, NULL, NULL, 0);
-    } else {
-        res = PQexec(conn, sql);
-    }
+static int epoll_fd = -1;
+static size_t total_out_bytes = 0; // octets en attente sur toutes les connexions
+static Connection *connections = NULL;
+static Connection *closed_connections = NULL; // libérées en fin de tour de boucle
 
-    if (PQresultStatus(res) != PGRES_TUPLES_OK && PQresultStatus(res) != PGRES_COMMAND_OK) {
-        snprintf(buffer, sizeof(buffer), "Connection to database failed: %s", PQerrorMessage(conn));
-        output_log(buffer);
-        PQclear(res);
-        PQfinish(conn);
-        return NULL;
+void log_context(Connection *cnx) {
+    if (cnx == NULL) {
+        ip_address[0] = '\0';
+    } else {
+        strcpy(ip_address, cnx->ip);
     }
+}
 
-    PQfinish(conn);
-    return res;
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
+void set_keepalive(int fd) {
+    int on = 1;
+    int idle = keepalive_idle;
+    int interval = KEEPALIVE_INTERVAL;
+    int count = KEEPALIVE_COUNT;
 
-const char* pg_get_attribute(PGresult *res, int row, const char *attribute_name) {
-    int nFields = PQnfields(res);
-    for (int i = 0; i < nFields; i++) {
-        if (strcmp(PQfname(res, i), attribute_name) == 0) {
-            if (PQntuples(res) > 0) {
-                return PQgetvalue(res, row, i);
-            }
-        }
+    if (keepalive_idle <= 0) return;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0
+        || setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) < 0
+        || setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) < 0
+        || setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) < 0) {
+        output_log("[Socket] Unable to enable TCP keepalive");
     }
-    return NULL;
 }
 
-void list_all(int cnx, User *usr) {
-    if (!usr->perms.list_logements) {
-        send(cnx, "Permission Denied.\n", 20, 0);
+void conn_timeout_expired(Timer *timer) {
+    Connection *cnx = container_of(timer, Connection, timeout);
+    log_context(cnx);
+    if (cnx->state == CNX_WAIT_AUTH) {
+        output_log("[Socket] Authentication timeout");
     } else {
-        const char *sql;
-        const char *paramValues[1];
-        int paramCount;
+        output_log("[Socket] Idle timeout");
+    }
+    conn_close(cnx);
+    log_context(NULL);
+}
 
-        if (usr->perms.admin){
-            sql = "SELECT id, titre FROM sae._logement;";
-            paramCount = 0;
-        } else {
-            sql = "SELECT id, titre FROM sae._logement WHERE id_proprietaire = $1;";
-            paramValues[0] = usr->id;
-            paramCount = 1;
-        }   
-        
-        PGresult *res = request(sql, paramValues, paramCount);
-        
-        if (res == NULL) {
-            send(cnx, "Error executing query.\n", 23, 0);
-            return;
-        }
+void conn_stalled(Timer *timer) {
+    char log_msg[BUFFER_SIZE];
+    Connection *cnx = container_of(timer, Connection, stall_timer);
+    log_context(cnx);
+    snprintf(log_msg, BUFFER_SIZE, "[Socket] Client stuck for %ds with %zu bytes pending, evicting", STALL_TIMEOUT, cnx->out_bytes);
+    output_log(log_msg);
+    conn_close(cnx);
+    log_context(NULL);
+}
 
-        int rows = PQntuples(res);
-        char json[BUFFER_SIZE] = "[";
-        char temp[BUFFER_SIZE];
-        char buffer[BUFFER_SIZE];
-        for (int i = 0; i < rows; i++) {
-            if (i > 0){
-                strcat(json, ", ");
-            }
-            snprintf(temp, BUFFER_SIZE, "{\"id\": %s, \"titre\": \"%s\"}",
-                    PQgetvalue(res, i, 0), PQgetvalue(res, i, 1));
-            strcat(json, temp);
-        }
-        strcat(json, "]");
+// Réarme le délai d'inactivité (celui d'authentification court depuis la connexion)
+void conn_touch(Connection *cnx) {
+    // Une connexion fermée est libérée en fin de tour : elle ne doit plus être dans la roue
+    if (cnx->dead || cnx->state != CNX_WAIT_ACTION) return;
+    if (idle_timeout > 0) {
+        timer_add(&cnx->timeout, idle_timeout * 1000ULL, conn_timeout_expired);
+    } else {
+        timer_cancel(&cnx->timeout);
+    }
+}
 
-        snprintf(buffer, sizeof(buffer), "[LIST_ALL] Result: %s", json);
-        output_log(buffer);
+void conn_update_events(Connection *cnx) {
+    if (cnx->dead) return;
 
-        strcat(json, "\n");
+    uint32_t wanted = 0;
+    // Tant que la file du client dépasse le seuil, ou qu'une commande attend
+    // la base, on ne lit plus ses commandes.
+    int paused = cnx->out_bytes >= OUTPUT_HIGH_WATER;
+    if (!cnx->closing && cnx->command == NULL && !cnx->busy && !paused) wanted |= EPOLLIN;
+    if (cnx->out_head != NULL) wanted |= EPOLLOUT;
 
-        send(cnx, json, strlen(json), 0);
-        PQclear(res);
+    if (paused != cnx->paused) {
+        output_log(paused ? "[Socket] Output queue full, pausing reads" : "[Socket] Output queue drained, resuming reads");
+        cnx->paused = paused;
+    }
+
+    if (wanted == cnx->events) return;
+
+    struct epoll_event ev;
+    ev.events = wanted;
+    ev.data.ptr = cnx;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, cnx->fd, &ev) < 0) {
+        output_log("[Socket] Unable to update connection events");
+        conn_close(cnx);
+        return;
     }
+    cnx->events = wanted;
 }
 
-#define MAX_ID_LENGTH 49
-#define MAX_DATE_LENGTH 10
+ssize_t conn_send(Connection *cnx, const void *data, size_t len) {
+    char log_msg[BUFFER_SIZE];
 
-void get_planning(int cnx, User *usr, const char *buffer) {
-    if (!usr->perms.calendrier_disponibilite) {
-        send(cnx, "Permission Denied.\n", 20, 0);
+    if (cnx->dead || cnx->closing) return -1;
+
+    // Limite globale atteinte : on évince d'abord les clients qui retiennent le plus de
+    // réponses sans les lire, et non celui qui répond à cet instant.
+    while (total_out_bytes + len > OUTPUT_GLOBAL_LIMIT) {
+        Connection *victim = cnx;
+        for (Connection *other = connections; other != NULL; other = other->next) {
+            if (other->out_bytes > victim->out_bytes) victim = other;
+        }
+
+        log_context(victim);
+        snprintf(log_msg, BUFFER_SIZE, "[Socket] Global output limit reached (%zu bytes pending), evicting client holding %zu bytes", total_out_bytes, victim->out_bytes);
+        output_log(log_msg);
+        conn_close(victim);
+        log_context(cnx);
+
+        if (victim == cnx) return -1;
+    }
+
+    // Mis en file seulement : conn_flush envoie la réponse et le prompt
+    // suivant en un seul writev, sans attendre l'ACK entre les deux (Nagle).
+    OutChunk *chunk = malloc(sizeof(OutChunk) + len);
+    if (chunk == NULL) {
+        output_log("[Socket] Unable to allocate output buffer");
+        conn_close(cnx);
+        return -1;
+    }
+    chunk->next = NULL;
+    chunk->len = len;
+    chunk->offset = 0;
+    memcpy(chunk->data, data, len);
+
+    if (cnx->out_tail == NULL) {
+        cnx->out_head = chunk;
+        timer_add(&cnx->stall_timer, STALL_TIMEOUT * 1000ULL, conn_stalled);
     } else {
-        char id[MAX_ID_LENGTH + 1] = {0};
-        char debut[MAX_DATE_LENGTH + 1] = {0};
-        char fin[MAX_DATE_LENGTH + 1] = {0};
-        char log_msg[BUFFER_SIZE];
+        cnx->out_tail->next = chunk;
+    }
+    cnx->out_tail = chunk;
+    cnx->out_bytes += len;
+    total_out_bytes += len;
+
+    return len;
+}
 
-        int parsed = sscanf(buffer + 13, "%49s %10s %10s", id, debut, fin);
+void conn_flush(Connection *cnx) {
+    struct iovec iov[MAX_IOV];
+    int progress = 0;
 
-        if (parsed < 2) {
-            send(cnx, "Invalid format. Usage: GET_PLANNING <ID> <DEBUT> [FIN]\n", 60, 0);
-            snprintf(log_msg, BUFFER_SIZE, "[Argument] Invalid format !");
-            output_log(log_msg);
-            return;
+    while (cnx->out_head != NULL) {
+        int count = 0;
+        for (OutChunk *chunk = cnx->out_head; chunk != NULL && count < MAX_IOV; chunk = chunk->next) {
+            iov[count].iov_base = chunk->data + chunk->offset;
+            iov[count].iov_len = chunk->len - chunk->offset;
+            count++;
         }
 
-        if (strlen(buffer) > strlen("GET_PLANNING") + MAX_ID_LENGTH + MAX_DATE_LENGTH * 2 + 3) {
-            send(cnx, "Input too long. Please check your parameters.\n", 47, 0);
-            snprintf(log_msg, BUFFER_SIZE, "[Argument] Input too long !");
-            output_log(log_msg);
+        ssize_t n = writev(cnx->fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            conn_close(cnx);
             return;
         }
 
-        if (!validate_date(debut)){
-            send(cnx, "Invalid start date formatt. (YYYY-mm-dd)\n", 42, 0);
-            snprintf(log_msg, BUFFER_SIZE, "[Argument] Start date (%s) invalid format !", debut);
-            output_log(log_msg);
-            return;
+        progress = 1;
+        cnx->out_bytes -= n;
+        total_out_bytes -= n;
+
+        while (n > 0) {
+            OutChunk *chunk = cnx->out_head;
+            size_t left = chunk->len - chunk->offset;
+            if ((size_t)n < left) {
+                chunk->offset += n;
+                break;
+            }
+            n -= left;
+            cnx->out_head = chunk->next;
+            free(chunk);
         }
+    }
 
-        if (strlen(fin) > 0 && !validate_date(fin)){
-            send(cnx, "Invalid end date foramt. (YYYY-mm-dd)\n", 39, 0);
-            snprintf(log_msg, BUFFER_SIZE, "[Argument] End date (%s) invalid format !", fin);
-            output_log(log_msg);
+    if (progress) {
+        conn_touch(cnx);
+        timer_add(&cnx->stall_timer, STALL_TIMEOUT * 1000ULL, conn_stalled);
+    }
+
+    if (cnx->out_head == NULL) {
+        cnx->out_tail = NULL;
+        timer_cancel(&cnx->stall_timer);
+        if (cnx->closing) {
+            conn_close(cnx);
             return;
         }
+    }
 
-        const char *sql;
-        const char *paramValues[4];
-        int paramCount;
+    conn_update_events(cnx);
+}
 
-        if (parsed == 2) {
-            if (usr->perms.admin){
-                sql = "SELECT * FROM sae._logement WHERE id = $1;";
-                paramValues[0] = id;
-                paramCount = 1;
-            } else {
-                sql = "SELECT * FROM sae._logement WHERE id = $1 AND id_proprietaire = $2;";
-                paramValues[0] = id;
-                paramValues[1] = usr->id;
-                paramCount = 2;
-            }
+void conn_close(Connection *cnx) {
+    if (cnx->dead) return;
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, cnx->fd, NULL);
+    close(cnx->fd);
+    timer_cancel(&cnx->timeout);
+    timer_cancel(&cnx->stall_timer);
+    scheduler_remove(cnx);
+    quota_release(cnx->quota);
+    cnx->quota = NULL;
+
+    // La requête en cours se termine sans lui
+    if (cnx->query != NULL) {
+        cnx->query->cnx = NULL;
+        cnx->query = NULL;
+    }
 
-            PGresult *res = request(sql, paramValues, paramCount);
+    while (cnx->out_head != NULL) {
+        OutChunk *chunk = cnx->out_head;
+        cnx->out_head = chunk->next;
+        free(chunk);
+    }
+    cnx->out_tail = NULL;
+    total_out_bytes -= cnx->out_bytes;
+    cnx->out_bytes = 0;
 
-            if (res == NULL || PQntuples(res) == 0) {
-                send(cnx, "Housing not found.\n", 20, 0);
-                PQclear(res);
-                return;
-            }
+    if (cnx->user != NULL) {
+        free(cnx->user);
+        cnx->user = NULL;
+    }
 
-            res = NULL;
+    if (cnx->prev != NULL) {
+        cnx->prev->next = cnx->next;
+    } else {
+        connections = cnx->next;
+    }
+    if (cnx->next != NULL) {
+        cnx->next->prev = cnx->prev;
+    }
 
-            if (usr->perms.admin){
-                sql = "SELECT date_debut, date_fin FROM sae._reservation r INNER JOIN sae._logement l ON  l.id = r.id_logement WHERE id_logement = $1 AND date_fin >= $2 ORDER BY date_debut;";
-                paramValues[0] = id;
-                paramValues[1] = debut;
-                paramCount = 2;
-            } else {
-                sql = "SELECT date_debut, date_fin FROM sae._reservation r INNER JOIN sae._logement l ON  l.id = r.id_logement WHERE id_logement = $1 AND date_fin >= $2 AND id_proprietaire = $3 ORDER BY date_debut;";
-                paramValues[0] = id;
-                paramValues[1] = debut;
-                paramValues[2] = usr->id;
-                paramCount = 3;
-            }
-        } else {
-            if (usr->perms.admin){
-                sql = "SELECT date_debut, date_fin FROM sae._reservation r INNER JOIN sae._logement l ON  l.id = r.id_logement WHERE id_logement = $1 AND date_fin >= $2 AND date_debut <= $3 ORDER BY date_debut;";
-                paramValues[0] = id;
-                paramValues[1] = debut;
-                paramValues[2] = fin;
-                paramCount = 3;
-            } else {
-                sql = "SELECT date_debut, date_fin FROM sae._reservation r INNER JOIN sae._logement l ON  l.id = r.id_logement WHERE id_logement = $1 AND date_fin >= $2 AND date_debut <= $3 AND id_proprietaire = $4 ORDER BY date_debut;";
-            }
-            paramValues[0] = id;
-            paramValues[1] = debut;
-            paramValues[2] = fin;
-            paramValues[3] = usr->id;
-            paramCount = 4;
-        }
+    cnx->dead = 1;
+    cnx->prev = NULL;
+    cnx->next = closed_connections;
+    closed_connections = cnx;
 
-        PGresult *res = request(sql, paramValues, paramCount);
-        
-        if (res == NULL) {
-            send(cnx, "Error executing query.\n", 23, 0);
-            return;
-        }
+    output_log("[Socket] Disconnection");
+}
 
-        int rows = PQntuples(res);
-        char json[BUFFER_SIZE] = "[";
-        char temp[BUFFER_SIZE];
+void prompt_auth(Connection *cnx) {
+    conn_send(cnx, "WAIT AUTH\n", 11);
+    output_log("Waiting for API key...");
+    printf("Waiting for API Key...\n");
+}
 
-        memset(log_msg, 0, BUFFER_SIZE);
-        for (int i = 0; i < rows; i++) {
-            if (i > 0) {
-                strcat(json, ", ");
-            }
-            snprintf(temp, BUFFER_SIZE, "{\"debut\": \"%s\", \"fin\": \"%s\"}",
-                    PQgetvalue(res, i, 0), PQgetvalue(res, i, 1));
-            strcat(json, temp);
-        }
-        strcat(json, "]");
+void prompt_action(Connection *cnx) {
+    printf("Waiting for action...\n");
+    conn_send(cnx, "WAIT ACTION\n", 13);
+    output_log("Waiting for action...");
+}
 
-        snprintf(log_msg, sizeof(log_msg), "[GET_AVAILABILITY] Result for logement %s: %s", id, json);
-        output_log(log_msg);
+static Quota *quotas[QUOTA_BUCKETS];
+static Quota *active_quotas = NULL; // utilisateurs ayant des commandes en attente
+static double virtual_time = 0;
+static int running_commands = 0;
 
-        strcat(json, "\n");
-        send(cnx, json, strlen(json), 0);
-        PQclear(res);
+// Poids dans la file équitable : les clés admin exportent tous les logements,
+// elles passent après les propriétaires qui consultent leurs plannings.
+int quota_weight(Permissions perms) {
+    return perms.admin ? 1 : 4;
+}
+
+int command_cost(User *usr, const char *buffer) {
+    if (strncasecmp(buffer, "LIST_ALL", 8) == 0 && usr->perms.admin) {
+        return 4;
     }
+    return 1;
 }
 
-void set_availability(int cnx, User *usr, const char *buffer) {
-    if (!usr->perms.mise_indispo) {
-        send(cnx, "Permission Denied.\n", 20, 0);
-        return;
+int is_db_command(const char *buffer) {
+    return strncasecmp(buffer, "LIST_ALL", 8) == 0
+        || strncasecmp(buffer, "GET_PLANNING", 12) == 0
+        || strncasecmp(buffer, "SET_AVAILABILITY", 16) == 0;
+}
+
+unsigned int quota_hash(const char *id) {
+    unsigned int hash = 5381;
+    while (*id) {
+        hash = hash * 33 + (unsigned char)*id++;
     }
+    return hash % QUOTA_BUCKETS;
+}
 
-    char id[MAX_ID_LENGTH + 1] = {0};
-    char status[2];
-    char log_msg[BUFFER_SIZE];
+void quota_refill(Quota *quota, uint64_t now) {
+    double rate = (double)rate_limit * quota->weight;
+    quota->tokens += (now - quota->refilled_ms) * rate / 1000.0;
+    if (quota->tokens > rate * RATE_BURST_SECONDS) {
+        quota->tokens = rate * RATE_BURST_SECONDS;
+    }
+    quota->refilled_ms = now;
+}
 
-    // Status 0 ou 1
-    int parsed = sscanf(buffer + 16, "%49s %1s", id, status);
+void quota_expired(Timer *timer) {
+    Quota *quota = container_of(timer, Quota, expiry);
+    if (quota->refs > 0 || quota->active) return;
 
-    if (parsed != 2) {
-        send(cnx, "Invalid format. Usage: SET_AVAILABILITY <ID> <0/1>\n", 50, 0);
-        snprintf(log_msg, BUFFER_SIZE, "[Argument] Invalid format !");
-        output_log(log_msg);
-        return;
+    Quota **link = &quotas[quota_hash(quota->id)];
+    while (*link != quota) {
+        link = &(*link)->next;
     }
+    *link = quota->next;
+    free(quota);
+}
 
-    if (strlen(buffer) > strlen("set_availability") + MAX_ID_LENGTH + 1) {
-        send(cnx, "Input too long. Please check your parameters.\n", 47, 0);
-        snprintf(log_msg, BUFFER_SIZE, "[Argument] Input too long !");
-        output_log(log_msg);
-        return;
+Quota* quota_acquire(User *usr) {
+    unsigned int bucket = quota_hash(usr->id);
+    Quota *quota = quotas[bucket];
+    while (quota != NULL && strcmp(quota->id, usr->id) != 0) {
+        quota = quota->next;
     }
 
-    const char *sql;
-    const char *paramValues[3];
-    int paramCount;
+    if (quota == NULL) {
+        quota = calloc(1, sizeof(Quota));
+        if (quota == NULL) return NULL;
+        strcpy(quota->id, usr->id);
+        quota->weight = quota_weight(usr->perms);
+        quota->tokens = (double)rate_limit * quota->weight * RATE_BURST_SECONDS;
+        quota->refilled_ms = monotonic_ms();
+        quota->next = quotas[bucket];
+        quotas[bucket] = quota;
+    }
 
-    sql = "UPDATE sae._logement l SET en_ligne = $1 WHERE l.id = $2 AND l.id_proprietaire = $3 RETURNING id, en_ligne;";
-    paramValues[0] = status;
-    paramValues[1] = id;
-    paramValues[2] = usr->id;
-    paramCount = 3;
+    quota->weight = quota_weight(usr->perms);
+    quota->refs++;
+    timer_cancel(&quota->expiry);
+    return quota;
+}
 
-    PGresult *res = request(sql, paramValues, paramCount);
-    
-    if (res == NULL) {
-        send(cnx, "Error executing query.\n", 23, 0);
-        return;
+void quota_release(Quota *quota) {
+    if (quota == NULL) return;
+    quota->refs--;
+    if (quota->refs > 0) return;
+
+    // On garde le seau jusqu'à ce qu'il soit plein, pour qu'une reconnexion
+    // ne remette pas les compteurs à zéro.
+    uint64_t delay = 0;
+    if (rate_limit > 0) {
+        quota_refill(quota, monotonic_ms());
+        double missing = (double)rate_limit * quota->weight * RATE_BURST_SECONDS - quota->tokens;
+        delay = (uint64_t)(missing * 1000.0 / ((double)rate_limit * quota->weight));
     }
+    timer_add(&quota->expiry, delay, quota_expired);
+}
 
-    int rows = PQntuples(res);
+// Retourne 0 si la commande peut passer, sinon le délai conseillé en ms
+int quota_admit(Quota *quota, int cost) {
+    if (quota->pending >= MAX_PENDING_PER_USER) {
+        return 1000;
+    }
+    if (rate_limit <= 0) return 0;
 
-    if (rows <= 0){
-        send(cnx, "ID not found\n", 47, 0);
-        snprintf(log_msg, BUFFER_SIZE, "[Argument] Invalid ID (not found for this owner)!");
-        output_log(log_msg);
+    quota_refill(quota, monotonic_ms());
+    if (quota->tokens >= cost) {
+        quota->tokens -= cost;
+        return 0;
     }
 
-    char json[BUFFER_SIZE] = "[";
-    char temp[BUFFER_SIZE];
+    double rate = (double)rate_limit * quota->weight;
+    int retry = (int)((cost - quota->tokens) * 1000.0 / rate) + 1;
+    return retry;
+}
 
-    memset(log_msg, 0, BUFFER_SIZE);
-    for (int i = 0; i < rows; i++) {
-        if (i > 0) {
-            strcat(json, ", ");
-        }
-        snprintf(temp, BUFFER_SIZE, "{\"id\": \"%s\", \"status\": \"%s\"}",
-                 PQgetvalue(res, i, 0), PQgetvalue(res, i, 1));
-        strcat(json, temp);
-    }
-    strcat(json, "]");
+void scheduler_enqueue(Connection *cnx, const char *buffer, int cost) {
+    Quota *quota = cnx->quota;
 
-    snprintf(log_msg, sizeof(log_msg), "[SET_DISPONIBILITE] Result for logement %s: %s", id, json);
-    output_log(log_msg);
+    cnx->command = strdup(buffer);
+    if (cnx->command == NULL) {
+        output_log("[Scheduler] Unable to queue command");
+        conn_close(cnx);
+        return;
+    }
+    cnx->cost = cost;
+    cnx->job_next = NULL;
+    cnx->job_prev = quota->queue_tail;
+    if (quota->queue_tail != NULL) {
+        quota->queue_tail->job_next = cnx;
+    } else {
+        quota->queue_head = cnx;
+    }
+    quota->queue_tail = cnx;
+    quota->pending++;
+
+    if (!quota->active) {
+        quota->vstart = quota->vfinish > virtual_time ? quota->vfinish : virtual_time;
+        quota->active = 1;
+        quota->active_prev = NULL;
+        quota->active_next = active_quotas;
+        if (active_quotas != NULL) active_quotas->active_prev = quota;
+        active_quotas = quota;
+    }
 
-    strcat(json, "\n");
-    send(cnx, json, strlen(json), 0);
-    PQclear(res);
+    conn_update_events(cnx);
 }
 
-User* authenticate(const char* api_key) {
-    const char *sql = "SELECT u.id, pseudo, permission FROM sae._api_keys a INNER JOIN sae._utilisateur u ON u.id = a.proprietaire WHERE key = $1;";
-    const char *paramValues[1] = {api_key};
-    int paramCount = 1;
-    PGresult *res = request(sql, paramValues, paramCount);
-    if (res == NULL){
-        return NULL;
+void scheduler_remove(Connection *cnx) {
+    Quota *quota = cnx->quota;
+    if (cnx->command == NULL) return;
+
+    if (cnx->job_prev != NULL) {
+        cnx->job_prev->job_next = cnx->job_next;
+    } else {
+        quota->queue_head = cnx->job_next;
+    }
+    if (cnx->job_next != NULL) {
+        cnx->job_next->job_prev = cnx->job_prev;
+    } else {
+        quota->queue_tail = cnx->job_prev;
     }
+    cnx->job_prev = NULL;
+    cnx->job_next = NULL;
+    quota->pending--;
 
-    if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) == 0) {
-        PQclear(res);
-        return NULL;
+    if (quota->queue_head == NULL && quota->active) {
+        if (quota->active_prev != NULL) {
+            quota->active_prev->active_next = quota->active_next;
+        } else {
+            active_quotas = quota->active_next;
+        }
+        if (quota->active_next != NULL) {
+            quota->active_next->active_prev = quota->active_prev;
+        }
+        quota->active = 0;
     }
 
-    User *user = malloc(sizeof(User));
-    strncpy(user->id, PQgetvalue(res, 0, 0), sizeof(user->id) - 1);
-    user->id[sizeof(user->id) - 1] = '\0';
+    free(cnx->command);
+    cnx->command = NULL;
+}
+
+// Fin d'une commande (cnx vaut NULL si le client est parti) : le client peut envoyer la suivante
+void command_finish(Connection *cnx) {
+    running_commands--;
+    if (cnx == NULL || cnx->dead) return;
 
-    strncpy(user->name, PQgetvalue(res, 0, 1), sizeof(user->name) - 1);
-    user->name[sizeof(user->name) - 1] = '\0';
+    cnx->busy = 0;
+    prompt_action(cnx);
+    conn_flush(cnx);
+}
 
-    user->perms = extract_permissions(PQgetvalue(res, 0, 2));
+void run_command(Connection *cnx, char *buffer) {
+    int submitted = 0;
 
-    PQclear(res);
-    return user;
+    if (strncasecmp(buffer, "LIST_ALL", 8) == 0) {
+        submitted = list_all(cnx, cnx->user);
+    } else if (strncasecmp(buffer, "GET_PLANNING", 12) == 0) {
+        submitted = get_planning(cnx, cnx->user, buffer);
+    } else if (strncasecmp(buffer, "SET_AVAILABILITY", 16) == 0) {
+        submitted = set_availability(cnx, cnx->user, buffer);
+    }
+
+    // Réponse immédiate (refus, arguments invalides, cache) : sinon le callback de la requête termine
+    if (!submitted) {
+        command_finish(cnx);
+    }
+}
+
+// Sert les commandes en attente, en choisissant à chaque fois l'utilisateur
+// dont le temps virtuel de départ est le plus petit (file équitable pondérée).
+// Les requêtes partent sans attendre : au plus DB_MAX_RUNNING commandes sont en cours.
+void scheduler_run() {
+    char buffer[BUFFER_SIZE];
+
+    while (running_commands < DB_MAX_RUNNING && active_quotas != NULL) {
+        Quota *quota = active_quotas;
+        for (Quota *other = active_quotas->active_next; other != NULL; other = other->active_next) {
+            if (other->vstart < quota->vstart) quota = other;
+        }
+
+        Connection *cnx = quota->queue_head;
+        virtual_time = quota->vstart;
+        quota->vfinish = quota->vstart + (double)cnx->cost / quota->weight;
+
+        strcpy(buffer, cnx->command);
+        scheduler_remove(cnx);
+        if (quota->active) {
+            quota->vstart = quota->vfinish;
+        }
+
+        running_commands++;
+        cnx->busy = 1;
+        log_context(cnx);
+        run_command(cnx, buffer);
+        log_context(NULL);
+    }
+}
+
+void handle_auth(Connection *cnx, char *buffer) {
+    char log_msg[BUFFER_SIZE]; // buffer pour les logs
+
+    clean_input(buffer);
+
+    snprintf(log_msg, BUFFER_SIZE, "API Key received : %s", buffer);
+    output_log(log_msg);
+
+    // Plus de lecture jusqu'à la réponse de la base, traitée par auth_done
+    cnx->busy = 1;
+    authenticate(cnx, buffer);
+}
+
+void auth_done(Connection *cnx, PGresult *res, void *data) {
+    char log_msg[BUFFER_SIZE]; // buffer pour les logs
+    char response[BUFFER_SIZE]; // buffer pour les responses
+    char *api_key = data;
+
+    if (cnx == NULL) {
+        free(api_key);
+        return;
+    }
+    cnx->busy = 0;
+
+    if (res != NULL && PQntuples(res) > 0) {
+        cnx->user = malloc(sizeof(User));
+    }
+    if (cnx->user == NULL) {
+        snprintf(log_msg, BUFFER_SIZE, "AUTH REFUSED (%s)", api_key);
+        output_log(log_msg);
+        free(api_key);
+        conn_send(cnx, log_msg, strlen(log_msg));
+        conn_send(cnx, "\n", 1);
+        prompt_auth(cnx);
+        if (!cnx->dead) conn_flush(cnx);
+        return;
+    }
+    free(api_key);
+
+    strncpy(cnx->user->id, PQgetvalue(res, 0, 0), sizeof(cnx->user->id) - 1);
+    cnx->user->id[sizeof(cnx->user->id) - 1] = '\0';
+
+    strncpy(cnx->user->name, PQgetvalue(res, 0, 1), sizeof(cnx->user->name) - 1);
+    cnx->user->name[sizeof(cnx->user->name) - 1] = '\0';
+
+    cnx->user->perms = extract_permissions(PQgetvalue(res, 0, 2));
+
+    snprintf(log_msg, BUFFER_SIZE, "[Authentification] API Key OK (%s)", cnx->user->name);
+    output_log(log_msg);
+
+    cnx->quota = quota_acquire(cnx->user);
+    if (cnx->quota == NULL) {
+        output_log("[Scheduler] Unable to allocate user quota");
+        conn_close(cnx);
+        return;
+    }
+
+    snprintf(response, BUFFER_SIZE, "AUTH OK %s\n", cnx->user->name);
+    conn_send(cnx, response, strlen(response));
+    if (cnx->dead) return;
+
+    cnx->state = CNX_WAIT_ACTION;
+    conn_touch(cnx);
+    prompt_action(cnx);
+    conn_flush(cnx);
+}
+
+void handle_action(Connection *cnx, char *buffer) {
+    char log_msg[BUFFER_SIZE]; // buffer pour les logs
+    char response[BUFFER_SIZE]; // buffer pour les responses
+    char formatter[BUFFER_SIZE]; // buffer pour formatter des chaines temporairement
+
+    memset(response, 0, sizeof(response));
+    memset(log_msg, 0, sizeof(log_msg));
+
+    snprintf(log_msg, BUFFER_SIZE, "[Command] Received %s", buffer);
+    output_log(log_msg);
+
+    if (is_db_command(buffer)) {
+        int cost = command_cost(cnx->user, buffer);
+        int retry = quota_admit(cnx->quota, cost);
+        if (retry > 0) {
+            snprintf(response, BUFFER_SIZE, "RETRY AFTER %d\n", retry);
+            conn_send(cnx, response, strlen(response));
+            snprintf(log_msg, BUFFER_SIZE, "[Rate limit] %s throttled, retry after %dms", cnx->user->name, retry);
+            output_log(log_msg);
+            prompt_action(cnx);
+            return;
+        }
+        // Exécutée par scheduler_run, le prompt suivant est envoyé après la réponse
+        scheduler_enqueue(cnx, buffer, cost);
+        return;
+    } else if (strncasecmp(buffer, "HELP", 4) == 0) {
+        snprintf(response, BUFFER_SIZE, "%-*s  %s\n", 36, "LIST_ALL", "List all logement.");
+        snprintf(formatter, BUFFER_SIZE, "%-*s  %s\n", 36, "GET_PLANNING <ID> <DEBUT> [FIN]", "List planing of specified logement. <ID>: Housing ID, <START>: Date of start, [END]; Date of end (optionnal).");
+        strcat(response, formatter);
+        snprintf(formatter, BUFFER_SIZE, "%-*s  %s\n", 36, "SET_AVAILABILITY <ID> <0/1>", "Set availability of the housing (0: Not availible, 1 : Availible). <ID>: Housing ID, <START>: Date of start, [END]; Date of end (optionnal).");
+        strcat(response, formatter);
+        snprintf(formatter, BUFFER_SIZE, "%-*s  %s\n", 36, "HELP", "Show the help.");
+        strcat(response, formatter);
+        snprintf(formatter, BUFFER_SIZE, "%-*s  %s\n", 36, "QUIT", "Quit the syslog.");                
+        strcat(response, formatter);
+        conn_send(cnx, response, strlen(response));
+    } else if (strncasecmp(buffer, "QUIT", 4) == 0) {
+        cnx->closing = 1;
+        return;
+    } else {
+        memset(log_msg, 0, sizeof(log_msg));
+        conn_send(cnx, "ACTION NOT FOUND\n", 18);
+        snprintf(log_msg, BUFFER_SIZE, "[Command] Unknown Command (%s)", buffer);
+        output_log(log_msg);
+    }
+
+    prompt_action(cnx);
+}
+
+void conn_read(Connection *cnx) {
+    char buffer[BUFFER_SIZE]; // buffer pour les saisies
+
+    memset(buffer, 0, BUFFER_SIZE);
+    ssize_t valread = read(cnx->fd, buffer, BUFFER_SIZE - 1);
+    if (valread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (valread <= 0) {
+        conn_close(cnx);
+        return;
+    }
+
+    conn_touch(cnx);
+    if (cnx->state == CNX_WAIT_AUTH) {
+        handle_auth(cnx, buffer);
+    } else {
+        handle_action(cnx, buffer);
+    }
+
+    if (!cnx->dead) {
+        conn_flush(cnx);
+    }
+}
+
+void accept_connections(int sock) {
+    struct sockaddr_in conn_addr;
+    socklen_t size;
+    struct epoll_event ev;
+
+    while (1) {
+        size = sizeof(conn_addr);
+        int fd = accept(sock, (struct sockaddr *)&conn_addr, &size);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                output_log("[Socket] Unable to accept connection");
+            }
+            return;
+        }
+
+        Connection *cnx = calloc(1, sizeof(Connection));
+        if (cnx == NULL || set_nonblocking(fd) < 0) {
+            output_log("[Socket] Unable to initialize connection");
+            free(cnx);
+            close(fd);
+            continue;
+        }
+        cnx->kind = EVENT_CLIENT;
+        cnx->fd = fd;
+        cnx->state = CNX_WAIT_AUTH;
+        cnx->events = EPOLLIN;
+        inet_ntop(AF_INET, &conn_addr.sin_addr, cnx->ip, INET_ADDRSTRLEN);
+        set_keepalive(fd);
+
+        ev.events = cnx->events;
+        ev.data.ptr = cnx;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            output_log("[Socket] Unable to register connection");
+            free(cnx);
+            close(fd);
+            continue;
+        }
+
+        cnx->next = connections;
+        if (connections != NULL) connections->prev = cnx;
+        connections = cnx;
+
+        if (auth_timeout > 0) {
+            timer_add(&cnx->timeout, auth_timeout * 1000ULL, conn_timeout_expired);
+        }
+
+        log_context(cnx);
+        output_log("[Socket] New connection");
+        prompt_auth(cnx);
+        conn_flush(cnx);
+        log_context(NULL);
+    }
+}
+
+static volatile sig_atomic_t stop_requested = 0;
+
+void request_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+void launch_socket() {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    char log_msg[BUFFER_SIZE]; // buffer pour les logs
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+    struct epoll_event events[MAX_EVENTS];
+
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        error("Socket Initialization", 0);
+    }
+
+    if (listen(sock, SOMAXCONN) < 0 || set_nonblocking(sock) < 0) {
+        error("Socket Initialization", 0);
+    }
+
+    // Un client qui ferme brutalement ne doit pas tuer le serveur
+    signal(SIGPIPE, SIG_IGN);
+
+    // Arrêt propre, pour sauvegarder le snapshot
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    timer_init();
+
+    if (replica_count > 0) {
+        static Timer health_timer;
+        db_health_check(&health_timer);
+    }
+
+    if (snapshot_path != NULL) {
+        housing_cache_start();
+    }
+
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        error("Socket Initialization", 0);
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // NULL : socket d'écoute
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+        error("Socket Initialization", 0);
+    }
+
+    snprintf(log_msg, BUFFER_SIZE, "[Socket] Listening on port: %d", port);
+    output_log(log_msg);
+
+    printf("Waiting for connection...\n");
+
+    while (!stop_requested) {
+        int wait = timer_next_timeout(monotonic_ms());
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, wait);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            error("Event loop", 0);
+        }
+
+        for (int i = 0; i < ready; i++) {
+            EventKind *source = events[i].data.ptr;
+            if (source == NULL) {
+                accept_connections(sock);
+                continue;
+            }
+            if (*source == EVENT_DATABASE) {
+                db_ready((DbServer *)source, events[i].events);
+                continue;
+            }
+
+            Connection *cnx = (Connection *)source;
+            if (cnx->dead) continue;
+
+            log_context(cnx);
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                conn_close(cnx);
+            } else {
+                if (events[i].events & EPOLLOUT) {
+                    conn_flush(cnx);
+                }
+                if (!cnx->dead && (events[i].events & EPOLLIN)) {
+                    conn_read(cnx);
+                }
+            }
+            log_context(NULL);
+        }
+
+        timer_advance(monotonic_ms());
+        scheduler_run();
+
+        while (closed_connections != NULL) {
+            Connection *cnx = closed_connections;
+            closed_connections = cnx->next;
+            free(cnx);
+        }
+    }
+
+    output_log("[Socket] Shutting down");
+    if (snapshot_path != NULL) {
+        housing_cache_stop();
+    }
+    close(sock);
+}
+
+// Accès à la base piloté par la boucle d'événements : chaque serveur garde une connexion
+// non bloquante dont la socket est surveillée par epoll, et exécute sa file de requêtes
+// une à une. Le résultat est rendu au callback de la requête, sans jamais attendre.
+
+void db_start(DbServer *db);
+void db_set_healthy(DbServer *db, int healthy, const char *reason);
+void db_query_expired(Timer *timer);
+
+void db_query_free(DbQuery *query) {
+    for (int i = 0; i < query->param_count; i++) {
+        free(query->params[i]);
+    }
+    free(query);
+}
+
+int db_set_events(DbServer *db, uint32_t wanted) {
+    struct epoll_event ev;
+    int fd = PQsocket(db->conn);
+    int op = EPOLL_CTL_MOD;
+
+    if (fd < 0) return -1;
+
+    // Pendant la connexion, libpq peut changer de socket (plusieurs adresses) : on réenregistre
+    if (fd != db->fd || db->state == DB_CONNECTING) {
+        if (db->fd >= 0) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, db->fd, NULL);
+        }
+        db->fd = -1;
+        op = EPOLL_CTL_ADD;
+    } else if (wanted == db->events) {
+        return 0;
+    }
+
+    ev.events = wanted;
+    ev.data.ptr = db;
+    if (epoll_ctl(epoll_fd, op, fd, &ev) < 0) {
+        output_log("[Database] Unable to watch database socket");
+        return -1;
+    }
+    db->fd = fd;
+    db->events = wanted;
+    return 0;
+}
+
+// Abandonne la connexion ; la suivante est ouverte à la prochaine requête
+void db_reset(DbServer *db) {
+    if (db->fd >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, db->fd, NULL);
+        db->fd = -1;
+    }
+    db->events = 0;
+    if (db->result != NULL) {
+        PQclear(db->result);
+        db->result = NULL;
+    }
+    if (db->conn != NULL) {
+        PQfinish(db->conn);
+        db->conn = NULL;
+    }
+    db->state = DB_DISCONNECTED;
+}
+
+void db_enqueue(DbServer *db, DbQuery *query, int front) {
+    query->db = db;
+    if (front) {
+        query->next = db->queue_head;
+        db->queue_head = query;
+        if (db->queue_tail == NULL) db->queue_tail = query;
+    } else {
+        query->next = NULL;
+        if (db->queue_tail != NULL) {
+            db->queue_tail->next = query;
+        } else {
+            db->queue_head = query;
+        }
+        db->queue_tail = query;
+    }
+}
+
+DbQuery* db_dequeue(DbServer *db) {
+    DbQuery *query = db->queue_head;
+    if (query == NULL) return NULL;
+
+    db->queue_head = query->next;
+    if (db->queue_head == NULL) db->queue_tail = NULL;
+    query->next = NULL;
+    return query;
+}
+
+void db_complete(DbQuery *query, PGresult *res) {
+    Connection *cnx = query->cnx;
+
+    timer_cancel(&query->deadline);
+    if (cnx != NULL) {
+        cnx->query = NULL;
+        log_context(cnx);
+    }
+    query->done(cnx, res, query->data);
+    log_context(NULL);
+
+    if (res != NULL) {
+        PQclear(res);
+    }
+    db_query_free(query);
+}
+
+// La requête n'a pas abouti sur son serveur : un réplica passe la main au primaire
+void db_fail(DbQuery *query) {
+    char buffer[BUFFER_SIZE];
+    DbServer *db = query->db;
+
+    if (db->replica) {
+        if (db->healthy) {
+            snprintf(buffer, sizeof(buffer), "[Database] Replica %s unreachable, falling back to primary", db->name);
+            output_log(buffer);
+            db->healthy = 0;
+        }
+        // Le temps perdu sur le réplica n'est pas décompté au primaire
+        query->retried = 0;
+        if (db_timeout > 0) {
+            timer_add(&query->deadline, db_timeout * 1000ULL, db_query_expired);
+        }
+        db_enqueue(&primary, query, 0);
+        db_start(&primary);
+        return;
+    }
+    db_complete(query, NULL);
+}
+
+void db_lost(DbServer *db) {
+    char buffer[BUFFER_SIZE];
+    DbQuery *query = db->running;
+    int connected = db->state == DB_IDLE || db->state == DB_BUSY;
+
+    snprintf(buffer, sizeof(buffer), "Connection to database failed: %s", PQerrorMessage(db->conn));
+    output_log(buffer);
+
+    db->running = NULL;
+    db_reset(db);
+
+    if (query != NULL) {
+        // Une connexion persistante a pu être coupée depuis la dernière requête : on réessaie une fois.
+        if (query->reused && !query->retried) {
+            query->retried = 1;
+            db_enqueue(db, query, 1);
+            db_start(db);
+            return;
+        }
+        db_fail(query);
+    }
+
+    if (connected) {
+        db_start(db);
+        return;
+    }
+    // Serveur injoignable : inutile de faire attendre le reste de la file
+    while ((query = db_dequeue(db)) != NULL) {
+        db_fail(query);
+    }
+}
+
+void db_connect(DbServer *db) {
+    db->conn = PQconnectStart(db->conninfo);
+    db->state = DB_CONNECTING;
+    db->reused = 0;
+    if (db->conn == NULL || PQstatus(db->conn) == CONNECTION_BAD || db_set_events(db, EPOLLOUT) < 0) {
+        db_lost(db);
+    }
+}
+
+// Envoie la requête suivante de la file, en ouvrant la connexion si besoin
+void db_start(DbServer *db) {
+    const char *paramValues[MAX_QUERY_PARAMS];
+    int sent;
+
+    if (db->running != NULL || db->queue_head == NULL) return;
+    if (db->state == DB_DISCONNECTED) {
+        db_connect(db);
+        return;
+    }
+    if (db->state != DB_IDLE) return;
+
+    DbQuery *query = db_dequeue(db);
+    for (int i = 0; i < query->param_count; i++) {
+        paramValues[i] = query->params[i];
+    }
+
+    db->running = query;
+    db->state = DB_BUSY;
+    query->reused = db->reused;
+    db->reused = 1;
+
+    if (query->param_count > 0){
+        sent = PQsendQueryParams(db->conn, query->sql, query->param_count, NULL, paramValues, NULL, NULL, 0);
+    } else {
+        sent = PQsendQuery(db->conn, query->sql);
+    }
+
+    // Ce qui n'a pas pu partir d'un coup est envoyé sur EPOLLOUT
+    int pending = sent ? PQflush(db->conn) : -1;
+    if (pending < 0 || db_set_events(db, pending ? EPOLLIN | EPOLLOUT : EPOLLIN) < 0) {
+        db_lost(db);
+    }
+}
+
+void db_ready(DbServer *db, uint32_t events) {
+    char buffer[BUFFER_SIZE];
+
+    if (db->conn == NULL) return;
+
+    if (db->state == DB_CONNECTING) {
+        PostgresPollingStatusType status = PQconnectPoll(db->conn);
+        if (status == PGRES_POLLING_FAILED) {
+            db_lost(db);
+        } else if (status == PGRES_POLLING_OK) {
+            if (PQsetnonblocking(db->conn, 1) < 0) {
+                db_lost(db);
+                return;
+            }
+            db->state = DB_IDLE;
+            if (db_set_events(db, EPOLLIN) < 0) {
+                db_lost(db);
+                return;
+            }
+            db_start(db);
+        } else if (db_set_events(db, status == PGRES_POLLING_READING ? EPOLLIN : EPOLLOUT) < 0) {
+            db_lost(db);
+        }
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        int pending = PQflush(db->conn);
+        if (pending < 0 || (pending == 0 && db_set_events(db, EPOLLIN) < 0)) {
+            db_lost(db);
+            return;
+        }
+    }
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) return;
+
+    // Connexion inactive : seule une coupure ou une notice peut arriver
+    if (!PQconsumeInput(db->conn)) {
+        db_lost(db);
+        return;
+    }
+    if (db->state != DB_BUSY) return;
+
+    while (!PQisBusy(db->conn)) {
+        PGresult *res = PQgetResult(db->conn);
+        if (res != NULL) {
+            if (db->result == NULL) {
+                db->result = res;
+            } else {
+                PQclear(res);
+            }
+            continue;
+        }
+
+        // Requête terminée
+        if (PQstatus(db->conn) != CONNECTION_OK) {
+            db_lost(db);
+            return;
+        }
+
+        DbQuery *query = db->running;
+        res = db->result;
+        db->running = NULL;
+        db->result = NULL;
+        db->state = DB_IDLE;
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK && PQresultStatus(res) != PGRES_COMMAND_OK) {
+            snprintf(buffer, sizeof(buffer), "Connection to database failed: %s", PQresultErrorMessage(res));
+            output_log(buffer);
+            PQclear(res);
+            res = NULL;
+        }
+
+        db_complete(query, res);
+        db_start(db);
+        return;
+    }
+}
+
+void db_query_expired(Timer *timer) {
+    char buffer[BUFFER_SIZE];
+    DbQuery *query = container_of(timer, DbQuery, deadline);
+    DbServer *db = query->db;
+
+    snprintf(buffer, sizeof(buffer), "[Database] Query on %s abandoned after %ds", db->name, db_timeout);
+    output_log(buffer);
+
+    if (db->running == query) {
+        // Pas de PQcancel, qui bloquerait la boucle : on coupe la connexion,
+        // et statement_timeout arrête la requête côté serveur.
+        db->running = NULL;
+        db_reset(db);
+    } else {
+        DbQuery **link = &db->queue_head;
+        DbQuery *prev = NULL;
+        while (*link != query) {
+            prev = *link;
+            link = &(*link)->next;
+        }
+        *link = query->next;
+        if (db->queue_tail == query) db->queue_tail = prev;
+
+        // Connexion qui ne s'établit pas : on la relance pour les requêtes suivantes
+        if (db->state == DB_CONNECTING) {
+            db_reset(db);
+        }
+    }
+
+    // Un réplica qui ne répond plus est écarté, et sa file passe au primaire
+    if (db->replica) {
+        DbQuery *waiting;
+        db_set_healthy(db, 0, "query timeout");
+        while ((waiting = db_dequeue(db)) != NULL) {
+            db_fail(waiting);
+        }
+    }
+
+    db_complete(query, NULL);
+    db_start(db);
+}
+
+void db_submit(DbServer *db, Connection *cnx, const char *sql, const char **paramValues, int paramCount, DbCallback done, void *data) {
+    DbQuery *query = calloc(1, sizeof(DbQuery));
+    int ok = query != NULL && paramCount <= MAX_QUERY_PARAMS;
+
+    for (int i = 0; ok && i < paramCount; i++) {
+        query->params[i] = strdup(paramValues[i]);
+        query->param_count = i + 1;
+        ok = query->params[i] != NULL;
+    }
+    if (!ok) {
+        output_log("[Database] Unable to allocate query");
+        if (query != NULL) db_query_free(query);
+        done(cnx, NULL, data);
+        return;
+    }
+
+    query->cnx = cnx;
+    query->sql = sql;
+    query->done = done;
+    query->data = data;
+    if (cnx != NULL) {
+        cnx->query = query;
+    }
+    if (db_timeout > 0) {
+        timer_add(&query->deadline, db_timeout * 1000ULL, db_query_expired);
+    }
+
+    db_enqueue(db, query, 0);
+    db_start(db);
+}
+
+DbServer* db_route(Connection *cnx, DbAccess access) {
+    static int next_replica = 0;
+    uint64_t now = monotonic_ms();
+
+    if (access == DB_WRITE) {
+        return &primary;
+    }
+
+    // Lecture de ses propres écritures : les réplicas peuvent être en retard
+    if (cnx != NULL && cnx->wrote_ms != 0 && now - cnx->wrote_ms < sticky_window * 1000ULL) {
+        return &primary;
+    }
+
+    for (int i = 0; i < replica_count; i++) {
+        DbServer *db = &replicas[next_replica];
+        next_replica = (next_replica + 1) % replica_count;
+        if (db->healthy) return db;
+    }
+    return &primary;
+}
+
+// Vérification de santé non bloquante : une connexion dédiée par serveur, avancée
+// à chaque tick. Le primaire donne sa position WAL, puis chaque réplica sa position rejouée.
+typedef struct {
+    uint64_t lsn;
+    uint64_t sent_ms; // envoi de la requête qui a fait le relevé
+} LsnReading;
+
+// Sous écriture continue, un réplica n'atteint jamais le dernier relevé : on garde
+// les précédents pour mesurer son retard sur le plus récent qu'il a rejoué.
+static LsnReading lsn_readings[LSN_READINGS];
+static int lsn_count = 0;
+static int lsn_next = 0;
+static Timer probe_timer;
+
+int parse_lsn(const char *text, uint64_t *lsn) {
+    unsigned int high, low;
+    if (sscanf(text, "%X/%X", &high, &low) != 2) return 0;
+    *lsn = ((uint64_t)high << 32) | low;
+    return 1;
+}
+
+void db_probe_poll(Timer *timer);
+void db_probe_start(DbServer *db);
+
+void db_set_healthy(DbServer *db, int healthy, const char *reason) {
+    char buffer[BUFFER_SIZE];
+
+    if (healthy && !db->healthy) {
+        snprintf(buffer, sizeof(buffer), "[Database] Replica %s healthy (lag %.1fs)", db->name, db->lag);
+        output_log(buffer);
+    } else if (!healthy && db->healthy) {
+        snprintf(buffer, sizeof(buffer), "[Database] Replica %s removed from reads (%s)", db->name, reason);
+        output_log(buffer);
+    }
+    // La connexion de service ne sert plus : on la ferme, sauf si des requêtes l'utilisent encore
+    if (!healthy && db->running == NULL && db->queue_head == NULL) {
+        db_reset(db);
+    }
+    db->healthy = healthy;
+}
+
+void db_probe_failed(DbServer *db, const char *reason) {
+    char buffer[BUFFER_SIZE];
+
+    if (db->probe != NULL) {
+        PQfinish(db->probe);
+        db->probe = NULL;
+    }
+    db->probe_state = PROBE_IDLE;
+
+    if (db->replica) {
+        db_set_healthy(db, 0, reason);
+    } else {
+        snprintf(buffer, sizeof(buffer), "[Database] Unable to read primary WAL position (%s)", reason);
+        output_log(buffer);
+        // Sans nouveau relevé, le retard des réplicas continue de croître jusqu'à leur éviction
+        if (lsn_count > 0) {
+            for (int i = 0; i < replica_count; i++) {
+                db_probe_start(&replicas[i]);
+            }
+        }
+    }
+}
+
+void db_probe_send(DbServer *db) {
+    int sent;
+
+    db->probe_sent_ms = monotonic_ms();
+    if (db->replica) {
+        // Hors récupération, le serveur n'est pas un réplica : ses données ne suivent pas le primaire
+        sent = PQsendQuery(db->probe, "SELECT pg_is_in_recovery(), pg_last_wal_replay_lsn();");
+    } else {
+        sent = PQsendQuery(db->probe, "SELECT pg_current_wal_lsn();");
+    }
+
+    if (!sent || PQflush(db->probe) != 0) {
+        db_probe_failed(db, "unreachable");
+        return;
+    }
+    db->probe_state = PROBE_QUERYING;
+}
+
+void db_probe_start(DbServer *db) {
+    if (db->probe_state != PROBE_IDLE) return;
+
+    db->probe_deadline = monotonic_ms() + (db_timeout > 0 ? db_timeout : HEALTH_CHECK_INTERVAL) * 1000ULL;
+    if (db->probe != NULL && PQstatus(db->probe) == CONNECTION_OK) {
+        db_probe_send(db);
+    } else {
+        if (db->probe != NULL) {
+            PQfinish(db->probe);
+        }
+        db->probe = PQconnectStart(db->conninfo);
+        if (db->probe == NULL || PQstatus(db->probe) == CONNECTION_BAD || PQsetnonblocking(db->probe, 1) < 0) {
+            db_probe_failed(db, "unreachable");
+            return;
+        }
+        db->probe_state = PROBE_CONNECTING;
+        db->probe_events = POLLOUT;
+    }
+
+    if (db->probe_state != PROBE_IDLE) {
+        timer_add(&probe_timer, TICK_MS, db_probe_poll);
+    }
+}
+
+void db_probe_result(DbServer *db, PGresult *res) {
+    char reason[64];
+
+    if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) == 0) {
+        db_probe_failed(db, "query failed");
+        return;
+    }
+
+    if (!db->replica) {
+        uint64_t lsn;
+        if (!parse_lsn(PQgetvalue(res, 0, 0), &lsn)) {
+            db_probe_failed(db, "invalid WAL position");
+            return;
+        }
+        lsn_readings[lsn_next].lsn = lsn;
+        lsn_readings[lsn_next].sent_ms = db->probe_sent_ms;
+        lsn_next = (lsn_next + 1) % LSN_READINGS;
+        if (lsn_count < LSN_READINGS) lsn_count++;
+        for (int i = 0; i < replica_count; i++) {
+            db_probe_start(&replicas[i]);
+        }
+        return;
+    }
+
+    if (strcmp(PQgetvalue(res, 0, 0), "t") != 0) {
+        db_set_healthy(db, 0, "not a replica");
+        return;
+    }
+
+    // Le retard est borné par l'âge du relevé du primaire le plus récent que le réplica a rejoué
+    uint64_t replayed;
+    if (!PQgetisnull(res, 0, 1) && parse_lsn(PQgetvalue(res, 0, 1), &replayed)) {
+        for (int i = 0; i < lsn_count; i++) {
+            if (lsn_readings[i].lsn <= replayed && lsn_readings[i].sent_ms > db->synced_ms) {
+                db->synced_ms = lsn_readings[i].sent_ms;
+            }
+        }
+    }
+    if (db->synced_ms == 0) {
+        db_set_healthy(db, 0, "not synced yet");
+        return;
+    }
+    db->lag = (monotonic_ms() - db->synced_ms) / 1000.0;
+    snprintf(reason, sizeof(reason), "lag %.1fs", db->lag);
+    db_set_healthy(db, db->lag <= replica_max_lag, reason);
+}
+
+void db_probe_step(DbServer *db) {
+    struct pollfd pfd;
+
+    if (db->probe_state == PROBE_IDLE) return;
+    if (monotonic_ms() >= db->probe_deadline) {
+        db_probe_failed(db, "timeout");
+        return;
+    }
+
+    pfd.fd = PQsocket(db->probe);
+    pfd.events = db->probe_state == PROBE_CONNECTING ? db->probe_events : POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) <= 0) return;
+
+    if (db->probe_state == PROBE_CONNECTING) {
+        PostgresPollingStatusType status = PQconnectPoll(db->probe);
+        if (status == PGRES_POLLING_FAILED) {
+            db_probe_failed(db, "unreachable");
+        } else if (status == PGRES_POLLING_OK) {
+            db_probe_send(db);
+        } else {
+            db->probe_events = status == PGRES_POLLING_READING ? POLLIN : POLLOUT;
+        }
+        return;
+    }
+
+    if (!PQconsumeInput(db->probe)) {
+        db_probe_failed(db, "unreachable");
+        return;
+    }
+    if (PQisBusy(db->probe)) return;
+
+    PGresult *res = PQgetResult(db->probe);
+    PGresult *extra;
+    while ((extra = PQgetResult(db->probe)) != NULL) {
+        PQclear(extra);
+    }
+    db->probe_state = PROBE_IDLE;
+    db_probe_result(db, res);
+    PQclear(res);
+}
+
+void db_probe_poll(Timer *timer) {
+    int busy = 0;
+
+    db_probe_step(&primary);
+    busy |= primary.probe_state != PROBE_IDLE;
+    for (int i = 0; i < replica_count; i++) {
+        db_probe_step(&replicas[i]);
+        busy |= replicas[i].probe_state != PROBE_IDLE;
+    }
+
+    if (busy) {
+        timer_add(timer, TICK_MS, db_probe_poll);
+    }
+}
+
+void db_health_check(Timer *timer) {
+    // Les réplicas sont interrogés une fois la position du primaire connue
+    db_probe_start(&primary);
+    timer_add(timer, HEALTH_CHECK_INTERVAL * 1000ULL, db_health_check);
+}
+
+// Cache des logements et de leurs réservations, tenu à jour depuis le journal sae._synk_changes
+// (rempli par des triggers, voir README) et sauvegardé dans un snapshot. Au démarrage, le
+// snapshot est projeté en mémoire et seules les modifications postérieures à sa position sont relues.
+
+static HousingCache housing_cache;
+static Timer housing_timer;
+static Timer snapshot_timer;
+static uint64_t housing_refresh_sent_ms = 0;
+
+// Les deux requêtes rendent la même forme : position (xmin de leur propre snapshot), puis une
+// ligne par réservation de chaque logement relu, ou une seule s'il n'en a pas, triées par logement.
+#define HOUSING_LOAD_SQL \
+    "WITH position AS (SELECT pg_snapshot_xmin(pg_current_snapshot())::text AS xmin) " \
+    "SELECT p.xmin, l.id, l.titre, l.id_proprietaire, r.date_debut, r.date_fin FROM position p " \
+    "LEFT JOIN sae._logement l ON true " \
+    "LEFT JOIN sae._reservation r ON r.id_logement = l.id " \
+    "ORDER BY l.id, r.date_debut;"
+
+// Un logement modifié est relu en entier, et retiré du cache s'il n'existe plus.
+// Les transactions à partir de xmin ont pu être invisibles : elles sont relues au passage suivant.
+#define HOUSING_CATCH_UP_SQL \
+    "WITH position AS (SELECT pg_snapshot_xmin(pg_current_snapshot())::text AS xmin), " \
+    "changed AS (SELECT DISTINCT id_logement AS id FROM sae._synk_changes WHERE xid >= $1::xid8) " \
+    "SELECT p.xmin, c.id, l.titre, l.id_proprietaire, r.date_debut, r.date_fin FROM position p " \
+    "LEFT JOIN changed c ON true " \
+    "LEFT JOIN sae._logement l ON l.id = c.id " \
+    "LEFT JOIN sae._reservation r ON r.id_logement = c.id " \
+    "ORDER BY c.id, r.date_debut;"
+
+void housing_free_reservations(Housing *housing) {
+    if (housing->owned) {
+        free((Reservation *)housing->reservations);
+    }
+    housing->reservations = NULL;
+    housing->reservation_count = 0;
+    housing->owned = 0;
+}
+
+void housing_cache_free(HousingCache *cache) {
+    for (int i = 0; i < cache->count; i++) {
+        housing_free_reservations(&cache->housings[i]);
+    }
+    free(cache->housings);
+    if (cache->mapping != NULL) {
+        munmap(cache->mapping, cache->mapping_size);
+    }
+    memset(cache, 0, sizeof(HousingCache));
+}
+
+// Servi seulement si le dernier rattrapage est récent, sinon les commandes interrogent la base
+int housing_cache_fresh() {
+    return housing_cache.loaded && housing_cache.synced_ms != 0
+        && monotonic_ms() - housing_cache.synced_ms <= HOUSING_MAX_AGE * 1000ULL;
+}
+
+// Position du logement, ou de la place où l'insérer
+int housing_find(int64_t id, int *found) {
+    int low = 0;
+    int high = housing_cache.count;
+
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (housing_cache.housings[middle].id < id) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    *found = low < housing_cache.count && housing_cache.housings[low].id == id;
+    return low;
+}
+
+// Fin des lignes du logement qui commence à row
+int housing_rows_end(PGresult *res, int row) {
+    int end = row + 1;
+    while (end < PQntuples(res) && strcmp(PQgetvalue(res, end, 1), PQgetvalue(res, row, 1)) == 0) {
+        end++;
+    }
+    return end;
+}
+
+int housing_read(PGresult *res, int row, int end, Housing *housing) {
+    int count = 0;
+
+    memset(housing, 0, sizeof(Housing));
+    housing->id = atoll(PQgetvalue(res, row, 1));
+    snprintf(housing->titre, sizeof(housing->titre), "%s", PQgetvalue(res, row, 2));
+    snprintf(housing->owner, sizeof(housing->owner), "%s", PQgetvalue(res, row, 3));
+
+    for (int i = row; i < end; i++) {
+        if (!PQgetisnull(res, i, 4)) count++;
+    }
+    if (count == 0) return 1;
+
+    // calloc : octets de bourrage à zéro, les réservations sont écrites telles quelles dans le snapshot
+    Reservation *reservations = calloc(count, sizeof(Reservation));
+    if (reservations == NULL) return 0;
+
+    count = 0;
+    for (int i = row; i < end; i++) {
+        if (PQgetisnull(res, i, 4)) continue;
+        snprintf(reservations[count].debut, sizeof(reservations[count].debut), "%s", PQgetvalue(res, i, 4));
+        snprintf(reservations[count].fin, sizeof(reservations[count].fin), "%s", PQgetvalue(res, i, 5));
+        count++;
+    }
+    housing->reservations = reservations;
+    housing->reservation_count = count;
+    housing->owned = 1;
+    return 1;
+}
+
+// Chargement complet, quand aucun snapshot n'est utilisable
+int housing_cache_reload(PGresult *res) {
+    HousingCache cache;
+    int rows = PQntuples(res);
+    int housings = 0;
+
+    if (rows == 0) return 0;
+    for (int row = 0; row < rows; row = housing_rows_end(res, row)) {
+        if (!PQgetisnull(res, row, 1)) housings++;
+    }
+
+    memset(&cache, 0, sizeof(cache));
+    cache.housings = calloc(housings > 0 ? housings : 1, sizeof(Housing));
+    if (cache.housings == NULL) return 0;
+
+    for (int row = 0; row < rows; row = housing_rows_end(res, row)) {
+        // Table vide : seule la position est rendue
+        if (PQgetisnull(res, row, 1)) continue;
+        if (!housing_read(res, row, housing_rows_end(res, row), &cache.housings[cache.count])) {
+            housing_cache_free(&cache);
+            return 0;
+        }
+        cache.count++;
+    }
+
+    cache.position = strtoull(PQgetvalue(res, 0, 0), NULL, 10);
+    cache.loaded = 1;
+    cache.dirty = 1;
+    housing_cache_free(&housing_cache);
+    housing_cache = cache;
+    return 1;
+}
+
+// Remplace les logements modifiés ; rejouer les mêmes lignes donne le même résultat,
+// la position n'avance donc qu'une fois tout appliqué.
+int housing_cache_apply(PGresult *res, int *changed) {
+    int rows = PQntuples(res);
+    int found;
+
+    if (rows == 0) return 0;
+
+    for (int row = 0; row < rows; row = housing_rows_end(res, row)) {
+        if (PQgetisnull(res, row, 1)) continue;
+
+        int index = housing_find(atoll(PQgetvalue(res, row, 1)), &found);
+        (*changed)++;
+
+        // Logement supprimé
+        if (PQgetisnull(res, row, 2)) {
+            if (found) {
+                housing_free_reservations(&housing_cache.housings[index]);
+                memmove(&housing_cache.housings[index], &housing_cache.housings[index + 1], (housing_cache.count - index - 1) * sizeof(Housing));
+                housing_cache.count--;
+            }
+            continue;
+        }
+
+        Housing housing;
+        if (!housing_read(res, row, housing_rows_end(res, row), &housing)) return 0;
+
+        if (found) {
+            housing_free_reservations(&housing_cache.housings[index]);
+        } else {
+            Housing *housings = realloc(housing_cache.housings, (housing_cache.count + 1) * sizeof(Housing));
+            if (housings == NULL) {
+                housing_free_reservations(&housing);
+                return 0;
+            }
+            housing_cache.housings = housings;
+            memmove(&housing_cache.housings[index + 1], &housing_cache.housings[index], (housing_cache.count - index) * sizeof(Housing));
+            housing_cache.count++;
+        }
+        housing_cache.housings[index] = housing;
+    }
+
+    housing_cache.position = strtoull(PQgetvalue(res, 0, 0), NULL, 10);
+    return 1;
+}
+
+void housing_cache_refresh(Timer *timer);
+
+void housing_cache_loaded(Connection *cnx, PGresult *res, void *data) {
+    char log_msg[BUFFER_SIZE];
+    uint64_t delay = HOUSING_REFRESH_INTERVAL * 1000ULL;
+    (void)cnx;
+    (void)data;
+
+    if (res != NULL && housing_cache_reload(res)) {
+        housing_cache.synced_ms = housing_refresh_sent_ms;
+        housing_cache.synced_at = time(NULL);
+        snprintf(log_msg, BUFFER_SIZE, "[Cache] Loaded %d housings from database", housing_cache.count);
+        output_log(log_msg);
+    } else {
+        output_log("[Cache] Unable to load housings, retrying later");
+        delay = HOUSING_RETRY_INTERVAL * 1000ULL;
+    }
+
+    timer_add(&housing_timer, delay, housing_cache_refresh);
+}
+
+void housing_cache_caught_up(Connection *cnx, PGresult *res, void *data) {
+    char log_msg[BUFFER_SIZE];
+    uint64_t delay = HOUSING_REFRESH_INTERVAL * 1000ULL;
+    int changed = 0;
+    (void)cnx;
+    (void)data;
+
+    if (res != NULL && housing_cache_apply(res, &changed)) {
+        if (housing_cache.synced_ms == 0 || changed > 0) {
+            snprintf(log_msg, BUFFER_SIZE, "[Cache] Caught up from change log, %d housings updated", changed);
+            output_log(log_msg);
+        }
+        housing_cache.synced_ms = housing_refresh_sent_ms;
+        housing_cache.synced_at = time(NULL);
+        if (changed > 0) housing_cache.dirty = 1;
+    } else {
+        output_log("[Cache] Unable to read change log (sae._synk_changes), retrying later");
+        delay = HOUSING_RETRY_INTERVAL * 1000ULL;
+    }
+
+    timer_add(&housing_timer, delay, housing_cache_refresh);
+}
+
+// Toujours sur le primaire : la position n'a de sens que sur le serveur qui l'a donnée
+void housing_cache_refresh(Timer *timer) {
+    char position[32];
+    const char *paramValues[1] = {position};
+    (void)timer;
+
+    housing_refresh_sent_ms = monotonic_ms();
+    if (!housing_cache.loaded) {
+        db_submit(&primary, NULL, HOUSING_LOAD_SQL, NULL, 0, housing_cache_loaded, NULL);
+        return;
+    }
+
+    snprintf(position, sizeof(position), "%llu", (unsigned long long)housing_cache.position);
+    db_submit(&primary, NULL, HOUSING_CATCH_UP_SQL, paramValues, 1, housing_cache_caught_up, NULL);
+}
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int snapshot_write(const char *path) {
+    char tmp_path[SNAPSHOT_PATH_MAX];
+    char log_msg[BUFFER_SIZE];
+    SnapshotHeader header;
+    SnapshotHousing record;
+    uint64_t checksum = 14695981039346656037ULL;
+    uint32_t reservation_count = 0;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        snprintf(log_msg, BUFFER_SIZE, "[Snapshot] Unable to open %s: %s", tmp_path, strerror(errno));
+        output_log(log_msg);
+        return 0;
+    }
+
+    // En-tête réécrit à la fin, une fois la somme de contrôle connue
+    memset(&header, 0, sizeof(header));
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    for (int i = 0; ok && i < housing_cache.count; i++) {
+        const Housing *housing = &housing_cache.housings[i];
+        memset(&record, 0, sizeof(record));
+        record.id = housing->id;
+        memcpy(record.owner, housing->owner, sizeof(record.owner));
+        memcpy(record.titre, housing->titre, sizeof(record.titre));
+        record.reservation_count = housing->reservation_count;
+        reservation_count += housing->reservation_count;
+        checksum = fnv1a(checksum, &record, sizeof(record));
+        ok = fwrite(&record, sizeof(record), 1, file) == 1;
+    }
+    for (int i = 0; ok && i < housing_cache.count; i++) {
+        const Housing *housing = &housing_cache.housings[i];
+        size_t len = housing->reservation_count * sizeof(Reservation);
+        checksum = fnv1a(checksum, housing->reservations, len);
+        ok = len == 0 || fwrite(housing->reservations, len, 1, file) == 1;
+    }
+
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.housing_count = housing_cache.count;
+    header.reservation_count = reservation_count;
+    header.position = housing_cache.position;
+    header.synced_at = housing_cache.synced_at;
+    header.checksum = checksum;
+
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok || rename(tmp_path, path) < 0) {
+        snprintf(log_msg, BUFFER_SIZE, "[Snapshot] Unable to write %.*s: %s", SNAPSHOT_PATH_MAX, path, strerror(errno));
+        output_log(log_msg);
+        unlink(tmp_path);
+        return 0;
+    }
+
+    snprintf(log_msg, BUFFER_SIZE, "[Snapshot] Saved %u housings and %u reservations", header.housing_count, header.reservation_count);
+    output_log(log_msg);
+    return 1;
+}
+
+// Projette le snapshot : les réservations sont lues en place, seuls les logements sont indexés
+int snapshot_load(const char *path, HousingCache *cache) {
+    char log_msg[BUFFER_SIZE];
+    struct stat st;
+    uint64_t started = monotonic_ms();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        snprintf(log_msg, BUFFER_SIZE, "[Snapshot] No snapshot at %.*s, loading from database", SNAPSHOT_PATH_MAX, path);
+        output_log(log_msg);
+        return 0;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        output_log("[Snapshot] Snapshot truncated, loading from database");
+        return 0;
+    }
+
+    size_t size = st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        output_log("[Snapshot] Unable to map snapshot, loading from database");
+        return 0;
+    }
+
+    const SnapshotHeader *header = data;
+    const SnapshotHousing *records = (const SnapshotHousing *)(header + 1);
+    int valid = memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0
+        && header->version == SNAPSHOT_VERSION
+        && header->housing_count <= INT32_MAX
+        && header->reservation_count <= INT32_MAX
+        && sizeof(SnapshotHeader) + (uint64_t)header->housing_count * sizeof(SnapshotHousing)
+            + (uint64_t)header->reservation_count * sizeof(Reservation) == size
+        && fnv1a(14695981039346656037ULL, records, size - sizeof(SnapshotHeader)) == header->checksum;
+
+    if (!valid) {
+        munmap(data, size);
+        output_log("[Snapshot] Invalid or outdated snapshot, loading from database");
+        return 0;
+    }
+
+    // Le journal est purgé : au-delà, des modifications ne pourraient plus être rattrapées
+    if (time(NULL) - header->synced_at > SNAPSHOT_MAX_AGE) {
+        munmap(data, size);
+        output_log("[Snapshot] Snapshot older than the change log, loading from database");
+        return 0;
+    }
+
+    const Reservation *reservations = (const Reservation *)(records + header->housing_count);
+    Housing *housings = calloc(header->housing_count > 0 ? header->housing_count : 1, sizeof(Housing));
+    uint64_t offset = 0;
+
+    // Les chaînes sont lues en place : elles doivent être terminées, et les logements triés
+    for (uint32_t i = 0; valid && housings != NULL && i < header->housing_count; i++) {
+        const SnapshotHousing *record = &records[i];
+        valid = memchr(record->owner, '\0', sizeof(record->owner)) != NULL
+            && memchr(record->titre, '\0', sizeof(record->titre)) != NULL
+            && (i == 0 || records[i - 1].id < record->id)
+            && offset + record->reservation_count <= header->reservation_count;
+        for (uint32_t j = 0; valid && j < record->reservation_count; j++) {
+            valid = memchr(reservations[offset + j].debut, '\0', sizeof(reservations[offset + j].debut)) != NULL
+                && memchr(reservations[offset + j].fin, '\0', sizeof(reservations[offset + j].fin)) != NULL;
+        }
+        if (!valid) break;
+
+        housings[i].id = record->id;
+        memcpy(housings[i].owner, record->owner, sizeof(housings[i].owner));
+        memcpy(housings[i].titre, record->titre, sizeof(housings[i].titre));
+        housings[i].reservations = reservations + offset;
+        housings[i].reservation_count = record->reservation_count;
+        offset += record->reservation_count;
+    }
+
+    if (housings == NULL || !valid || offset != header->reservation_count) {
+        free(housings);
+        munmap(data, size);
+        output_log("[Snapshot] Invalid or outdated snapshot, loading from database");
+        return 0;
+    }
+
+    cache->housings = housings;
+    cache->count = header->housing_count;
+    cache->mapping = data;
+    cache->mapping_size = size;
+    cache->position = header->position;
+    cache->synced_at = header->synced_at;
+    cache->loaded = 1;
+
+    snprintf(log_msg, BUFFER_SIZE, "[Snapshot] Loaded %d housings and %u reservations from snapshot (checked in %llums), catching up from the change log",
+        cache->count, header->reservation_count, (unsigned long long)(monotonic_ms() - started));
+    output_log(log_msg);
+    return 1;
+}
+
+void snapshot_periodic(Timer *timer) {
+    if (housing_cache.dirty && snapshot_write(snapshot_path)) {
+        housing_cache.dirty = 0;
+    }
+    timer_add(timer, SNAPSHOT_INTERVAL * 1000ULL, snapshot_periodic);
+}
+
+void housing_cache_start() {
+    snapshot_load(snapshot_path, &housing_cache);
+    // Rattrapage au prochain tick : ne relit que ce qui a changé depuis la position du snapshot
+    timer_add(&housing_timer, 0, housing_cache_refresh);
+    timer_add(&snapshot_timer, SNAPSHOT_INTERVAL * 1000ULL, snapshot_periodic);
+}
+
+// À l'arrêt, on sauvegarde aussi la dernière position, même sans modification
+void housing_cache_stop() {
+    if (housing_cache.loaded && (housing_cache.dirty || housing_cache.synced_ms != 0)) {
+        snapshot_write(snapshot_path);
+    }
+}
+
+void list_all_cached(Connection *cnx, User *usr) {
+    char json[BUFFER_SIZE] = "[";
+    char temp[BUFFER_SIZE];
+    char log_msg[BUFFER_SIZE];
+    int admin = usr->perms.admin;
+    int rows = 0;
+
+    for (int i = 0; i < housing_cache.count; i++) {
+        const Housing *housing = &housing_cache.housings[i];
+        if (!admin && strcmp(housing->owner, usr->id) != 0) continue;
+
+        snprintf(temp, BUFFER_SIZE, "%s{\"id\": %lld, \"titre\": \"%s\"}", rows > 0 ? ", " : "", (long long)housing->id, housing->titre);
+        // Réponse trop longue pour un seul buffer : on envoie ce qui précède
+        if (strlen(json) + strlen(temp) + 3 >= BUFFER_SIZE) {
+            conn_send(cnx, json, strlen(json));
+            // conn_send a pu fermer la connexion, et libérer usr avec elle
+            if (cnx->dead) return;
+            json[0] = '\0';
+        }
+        strcat(json, temp);
+        rows++;
+    }
+    strcat(json, "]\n");
+
+    snprintf(log_msg, sizeof(log_msg), "[LIST_ALL] Result: %d housings (cache)", rows);
+    output_log(log_msg);
+
+    conn_send(cnx, json, strlen(json));
+}
+
+// Date au format de la base (YYYY-MM-DD), comparable telle quelle aux réservations en cache
+int normalize_date(const char *input, char *output) {
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(input, "%Y-%m-%d", &tm);
+    if (end == NULL || *end != '\0') return 0;
+    return strftime(output, 11, "%Y-%m-%d", &tm) == 10;
+}
+
+// Même réponse que les requêtes de get_planning ; retourne 0 si les arguments ne peuvent pas
+// être comparés tels quels au cache, la base répond alors.
+int get_planning_cached(Connection *cnx, User *usr, const char *id, const char *debut, const char *fin) {
+    char json[BUFFER_SIZE] = "[";
+    char temp[BUFFER_SIZE];
+    char log_msg[BUFFER_SIZE];
+    char from[11];
+    char to[11] = "";
+    char *end;
+    int found;
+    int rows = 0;
+
+    if (!normalize_date(debut, from) || (strlen(fin) > 0 && !normalize_date(fin, to))) return 0;
+
+    errno = 0;
+    long long value = strtoll(id, &end, 10);
+    if (end == id || *end != '\0' || errno != 0) return 0;
+
+    int index = housing_find(value, &found);
+    const Housing *housing = found ? &housing_cache.housings[index] : NULL;
+    if (housing != NULL && !usr->perms.admin && strcmp(housing->owner, usr->id) != 0) {
+        housing = NULL;
+    }
+
+    // Sans date de fin, la base vérifie d'abord que le logement existe
+    if (housing == NULL && strlen(fin) == 0) {
+        conn_send(cnx, "Housing not found.\n", 20);
+        return 1;
+    }
+
+    for (int i = 0; housing != NULL && i < housing->reservation_count; i++) {
+        const Reservation *reservation = &housing->reservations[i];
+        if (strcmp(reservation->fin, from) < 0) continue;
+        if (to[0] != '\0' && strcmp(reservation->debut, to) > 0) continue;
+
+        snprintf(temp, BUFFER_SIZE, "%s{\"debut\": \"%s\", \"fin\": \"%s\"}", rows > 0 ? ", " : "", reservation->debut, reservation->fin);
+        // Réponse trop longue pour un seul buffer : on envoie ce qui précède
+        if (strlen(json) + strlen(temp) + 3 >= BUFFER_SIZE) {
+            conn_send(cnx, json, strlen(json));
+            if (cnx->dead) return 1;
+            json[0] = '\0';
+        }
+        strcat(json, temp);
+        rows++;
+    }
+    strcat(json, "]\n");
+
+    snprintf(log_msg, sizeof(log_msg), "[GET_AVAILABILITY] Result for logement %s: %d reservations (cache)", id, rows);
+    output_log(log_msg);
+
+    conn_send(cnx, json, strlen(json));
+    return 1;
+}
+
+const char* pg_get_attribute(PGresult *res, int row, const char *attribute_name) {
+    int nFields = PQnfields(res);
+    for (int i = 0; i < nFields; i++) {
+        if (strcmp(PQfname(res, i), attribute_name) == 0) {
+            if (PQntuples(res) > 0) {
+                return PQgetvalue(res, row, i);
+            }
+        }
+    }
+    return NULL;
+}
+
+void list_all_done(Connection *cnx, PGresult *res, void *data) {
+    (void)data;
+
+    if (cnx == NULL) {
+        command_finish(NULL);
+        return;
+    }
+
+    if (res == NULL) {
+        conn_send(cnx, "Error executing query.\n", 23);
+        command_finish(cnx);
+        return;
+    }
+
+    int rows = PQntuples(res);
+    char json[BUFFER_SIZE] = "[";
+    char temp[BUFFER_SIZE];
+    char buffer[BUFFER_SIZE + 128]; // le JSON et son préfixe
+    for (int i = 0; i < rows; i++) {
+        if (i > 0){
+            strcat(json, ", ");
+        }
+        snprintf(temp, BUFFER_SIZE, "{\"id\": %s, \"titre\": \"%s\"}",
+                PQgetvalue(res, i, 0), PQgetvalue(res, i, 1));
+        strcat(json, temp);
+    }
+    strcat(json, "]");
+
+    snprintf(buffer, sizeof(buffer), "[LIST_ALL] Result: %s", json);
+    output_log(buffer);
+
+    strcat(json, "\n");
+
+    conn_send(cnx, json, strlen(json));
+    command_finish(cnx);
+}
+
+// Retourne 1 si une requête est partie : list_all_done termine alors la commande
+int list_all(Connection *cnx, User *usr) {
+    if (!usr->perms.list_logements) {
+        conn_send(cnx, "Permission Denied.\n", 20);
+        return 0;
+    }
+    if (housing_cache_fresh()) {
+        list_all_cached(cnx, usr);
+        return 0;
+    }
+
+    const char *sql;
+    const char *paramValues[1];
+    int paramCount;
+
+    if (usr->perms.admin){
+        sql = "SELECT id, titre FROM sae._logement;";
+        paramCount = 0;
+    } else {
+        sql = "SELECT id, titre FROM sae._logement WHERE id_proprietaire = $1;";
+        paramValues[0] = usr->id;
+        paramCount = 1;
+    }   
+
+    db_submit(db_route(cnx, DB_READ), cnx, sql, paramValues, paramCount, list_all_done, NULL);
+    return 1;
+}
+
+#define MAX_ID_LENGTH 49
+#define MAX_DATE_LENGTH 10
+
+// Arguments de GET_PLANNING, conservés entre la vérification du logement et la lecture des réservations
+typedef struct {
+    char id[MAX_ID_LENGTH + 1];
+    char debut[MAX_DATE_LENGTH + 1];
+    char fin[MAX_DATE_LENGTH + 1];
+    char owner[50];
+    int admin;
+} PlanningArgs;
+
+void planning_done(Connection *cnx, PGresult *res, void *data) {
+    PlanningArgs *args = data;
+    char log_msg[BUFFER_SIZE + 128];
+
+    if (cnx == NULL) {
+        free(args);
+        command_finish(NULL);
+        return;
+    }
+
+    if (res == NULL) {
+        conn_send(cnx, "Error executing query.\n", 23);
+        free(args);
+        command_finish(cnx);
+        return;
+    }
+
+    int rows = PQntuples(res);
+    char json[BUFFER_SIZE] = "[";
+    char temp[BUFFER_SIZE];
+
+    memset(log_msg, 0, BUFFER_SIZE);
+    for (int i = 0; i < rows; i++) {
+        if (i > 0) {
+            strcat(json, ", ");
+        }
+        snprintf(temp, BUFFER_SIZE, "{\"debut\": \"%s\", \"fin\": \"%s\"}",
+                PQgetvalue(res, i, 0), PQgetvalue(res, i, 1));
+        strcat(json, temp);
+    }
+    strcat(json, "]");
+
+    snprintf(log_msg, sizeof(log_msg), "[GET_AVAILABILITY] Result for logement %s: %s", args->id, json);
+    output_log(log_msg);
+
+    strcat(json, "\n");
+    conn_send(cnx, json, strlen(json));
+    free(args);
+    command_finish(cnx);
+}
+
+void planning_query(Connection *cnx, PlanningArgs *args) {
+    const char *sql;
+    const char *paramValues[4];
+    int paramCount;
+
+    if (strlen(args->fin) == 0) {
+        if (args->admin){
+            sql = "SELECT date_debut, date_fin FROM sae._reservation r INNER JOIN sae._logement l ON  l.id = r.id_logement WHERE id_logement = $1 AND date_fin >= $2 ORDER BY date_debut;";
+            paramValues[0] = args->id;
+            paramValues[1] = args->debut;
+            paramCount = 2;
+        } else {
+            sql = "SELECT date_debut, date_fin FROM sae._reservation r INNER JOIN sae._logement l ON  l.id = r.id_logement WHERE id_logement = $1 AND date_fin >= $2 AND id_proprietaire = $3 ORDER BY date_debut;";
+            paramValues[0] = args->id;
+            paramValues[1] = args->debut;
+            paramValues[2] = args->owner;
+            paramCount = 3;
+        }
+    } else {
+        if (args->admin){
+            sql = "SELECT date_debut, date_fin FROM sae._reservation r INNER JOIN sae._logement l ON  l.id = r.id_logement WHERE id_logement = $1 AND date_fin >= $2 AND date_debut <= $3 ORDER BY date_debut;";
+        } else {
+            sql = "SELECT date_debut, date_fin FROM sae._reservation r INNER JOIN sae._logement l ON  l.id = r.id_logement WHERE id_logement = $1 AND date_fin >= $2 AND date_debut <= $3 AND id_proprietaire = $4 ORDER BY date_debut;";
+        }
+        paramValues[0] = args->id;
+        paramValues[1] = args->debut;
+        paramValues[2] = args->fin;
+        paramValues[3] = args->owner;
+        paramCount = 4;
+    }
+
+    db_submit(db_route(cnx, DB_READ), cnx, sql, paramValues, paramCount, planning_done, args);
+}
+
+void planning_checked(Connection *cnx, PGresult *res, void *data) {
+    PlanningArgs *args = data;
+
+    if (cnx == NULL) {
+        free(args);
+        command_finish(NULL);
+        return;
+    }
+
+    if (res == NULL || PQntuples(res) == 0) {
+        conn_send(cnx, "Housing not found.\n", 20);
+        free(args);
+        command_finish(cnx);
+        return;
+    }
+
+    planning_query(cnx, args);
+}
+
+// Retourne 1 si une requête est partie : planning_done termine alors la commande
+int get_planning(Connection *cnx, User *usr, const char *buffer) {
+    if (!usr->perms.calendrier_disponibilite) {
+        conn_send(cnx, "Permission Denied.\n", 20);
+        return 0;
+    }
+
+    char id[MAX_ID_LENGTH + 1] = {0};
+    char debut[MAX_DATE_LENGTH + 1] = {0};
+    char fin[MAX_DATE_LENGTH + 1] = {0};
+    char log_msg[BUFFER_SIZE + 128];
+
+    int parsed = sscanf(buffer + 13, "%49s %10s %10s", id, debut, fin);
+
+    if (parsed < 2) {
+        conn_send(cnx, "Invalid format. Usage: GET_PLANNING <ID> <DEBUT> [FIN]\n", 60);
+        snprintf(log_msg, BUFFER_SIZE, "[Argument] Invalid format !");
+        output_log(log_msg);
+        return 0;
+    }
+
+    if (strlen(buffer) > strlen("GET_PLANNING") + MAX_ID_LENGTH + MAX_DATE_LENGTH * 2 + 3) {
+        conn_send(cnx, "Input too long. Please check your parameters.\n", 47);
+        snprintf(log_msg, BUFFER_SIZE, "[Argument] Input too long !");
+        output_log(log_msg);
+        return 0;
+    }
+
+    if (!validate_date(debut)){
+        conn_send(cnx, "Invalid start date formatt. (YYYY-mm-dd)\n", 42);
+        snprintf(log_msg, BUFFER_SIZE, "[Argument] Start date (%s) invalid format !", debut);
+        output_log(log_msg);
+        return 0;
+    }
+
+    if (strlen(fin) > 0 && !validate_date(fin)){
+        conn_send(cnx, "Invalid end date foramt. (YYYY-mm-dd)\n", 39);
+        snprintf(log_msg, BUFFER_SIZE, "[Argument] End date (%s) invalid format !", fin);
+        output_log(log_msg);
+        return 0;
+    }
+
+    if (housing_cache_fresh() && get_planning_cached(cnx, usr, id, debut, fin)) {
+        return 0;
+    }
+
+    PlanningArgs *args = calloc(1, sizeof(PlanningArgs));
+    if (args == NULL) {
+        conn_send(cnx, "Error executing query.\n", 23);
+        return 0;
+    }
+    strcpy(args->id, id);
+    strcpy(args->debut, debut);
+    strcpy(args->fin, fin);
+    strcpy(args->owner, usr->id);
+    args->admin = usr->perms.admin;
+
+    if (parsed == 3) {
+        planning_query(cnx, args);
+        return 1;
+    }
+
+    // Sans date de fin, on vérifie d'abord que le logement existe (et appartient à l'utilisateur)
+    const char *sql;
+    const char *paramValues[2];
+    int paramCount;
+
+    if (args->admin){
+        sql = "SELECT * FROM sae._logement WHERE id = $1;";
+        paramValues[0] = args->id;
+        paramCount = 1;
+    } else {
+        sql = "SELECT * FROM sae._logement WHERE id = $1 AND id_proprietaire = $2;";
+        paramValues[0] = args->id;
+        paramValues[1] = args->owner;
+        paramCount = 2;
+    }
+
+    db_submit(db_route(cnx, DB_READ), cnx, sql, paramValues, paramCount, planning_checked, args);
+    return 1;
+}
+
+void availability_done(Connection *cnx, PGresult *res, void *data) {
+    char *id = data;
+    char log_msg[BUFFER_SIZE + 128];
+
+    if (cnx == NULL) {
+        free(id);
+        command_finish(NULL);
+        return;
+    }
+
+    // La fenêtre part de la fin de l'écriture ; même en erreur, une requête abandonnée a pu être appliquée
+    cnx->wrote_ms = monotonic_ms();
+
+    if (res == NULL) {
+        conn_send(cnx, "Error executing query.\n", 23);
+        free(id);
+        command_finish(cnx);
+        return;
+    }
+
+    int rows = PQntuples(res);
+
+    if (rows <= 0){
+        conn_send(cnx, "ID not found\n", 14);
+        snprintf(log_msg, BUFFER_SIZE, "[Argument] Invalid ID (not found for this owner)!");
+        output_log(log_msg);
+    }
+
+    char json[BUFFER_SIZE] = "[";
+    char temp[BUFFER_SIZE];
+
+    memset(log_msg, 0, BUFFER_SIZE);
+    for (int i = 0; i < rows; i++) {
+        if (i > 0) {
+            strcat(json, ", ");
+        }
+        snprintf(temp, BUFFER_SIZE, "{\"id\": \"%s\", \"status\": \"%s\"}",
+                 PQgetvalue(res, i, 0), PQgetvalue(res, i, 1));
+        strcat(json, temp);
+    }
+    strcat(json, "]");
+
+    snprintf(log_msg, sizeof(log_msg), "[SET_DISPONIBILITE] Result for logement %s: %s", id, json);
+    output_log(log_msg);
+
+    strcat(json, "\n");
+    conn_send(cnx, json, strlen(json));
+    free(id);
+    command_finish(cnx);
+}
+
+// Retourne 1 si une requête est partie : availability_done termine alors la commande
+int set_availability(Connection *cnx, User *usr, const char *buffer) {
+    if (!usr->perms.mise_indispo) {
+        conn_send(cnx, "Permission Denied.\n", 20);
+        return 0;
+    }
+
+    char id[MAX_ID_LENGTH + 1] = {0};
+    char status[2];
+    char log_msg[BUFFER_SIZE + 128];
+
+    // Status 0 ou 1
+    int parsed = sscanf(buffer + 16, "%49s %1s", id, status);
+
+    if (parsed != 2) {
+        conn_send(cnx, "Invalid format. Usage: SET_AVAILABILITY <ID> <0/1>\n", 50);
+        snprintf(log_msg, BUFFER_SIZE, "[Argument] Invalid format !");
+        output_log(log_msg);
+        return 0;
+    }
+
+    if (strlen(buffer) > strlen("set_availability") + MAX_ID_LENGTH + 1) {
+        conn_send(cnx, "Input too long. Please check your parameters.\n", 47);
+        snprintf(log_msg, BUFFER_SIZE, "[Argument] Input too long !");
+        output_log(log_msg);
+        return 0;
+    }
+
+    const char *sql;
+    const char *paramValues[3];
+    int paramCount;
+
+    sql = "UPDATE sae._logement l SET en_ligne = $1 WHERE l.id = $2 AND l.id_proprietaire = $3 RETURNING id, en_ligne;";
+    paramValues[0] = status;
+    paramValues[1] = id;
+    paramValues[2] = usr->id;
+    paramCount = 3;
+
+    char *logged_id = strdup(id);
+    if (logged_id == NULL) {
+        conn_send(cnx, "Error executing query.\n", 23);
+        return 0;
+    }
+
+    db_submit(db_route(cnx, DB_WRITE), cnx, sql, paramValues, paramCount, availability_done, logged_id);
+    return 1;
+}
+
+// Le résultat est traité par auth_done
+void authenticate(Connection *cnx, const char *api_key) {
+    const char *sql = "SELECT u.id, pseudo, permission FROM sae._api_keys a INNER JOIN sae._utilisateur u ON u.id = a.proprietaire WHERE key = $1;";
+    const char *paramValues[1] = {api_key};
+    int paramCount = 1;
+
+    char *key = strdup(api_key);
+    if (key == NULL) {
+        output_log("[Authentification] Unable to allocate API key");
+        conn_close(cnx);
+        return;
+    }
+    db_submit(db_route(NULL, DB_READ), cnx, sql, paramValues, paramCount, auth_done, key);
 }
 
 int validate_date(const char* input) {